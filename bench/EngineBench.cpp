@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "TestRig.hpp"
+
+// Steps N LogicMatrix/LatticeExpander pairs the way Rack's engine does: every frame, each
+// worker thread takes the next unstepped module from a shared counter until none are left, all
+// of them meet at a barrier, and then the expander messages are flipped.  Neighbouring modules
+// therefore run on different threads from frame to frame, so cache lines shared between
+// instances, or between a module and the expander writing into it, show up as slower blocks.
+//
+// Reports the time taken by each block of frames, as throughput and as tail latency against
+// the real-time budget:
+//
+//     EngineBench [pairs] [threads] [blocks]
+//
+// With no arguments it sweeps a range of pair and thread counts.
+//
+using namespace LogicMatrixConstants;
+
+static constexpr int x_blockSize = 256;
+static constexpr int x_warmupBlocks = 20;
+static constexpr int x_defaultBlocks = 400;
+static constexpr float x_sampleRate = 48000.f;
+
+// Rack's engine spins briefly and then sleeps; yielding instead of sleeping keeps runs with
+// more threads than cores moving without making the barrier itself the measurement.
+//
+struct Barrier
+{
+    std::atomic<int> m_count;
+    std::atomic<int> m_generation;
+    int m_numThreads;
+
+    explicit Barrier(int numThreads)
+        : m_count(0)
+        , m_generation(0)
+        , m_numThreads(numThreads)
+    {
+    }
+
+    void Wait()
+    {
+        int generation = m_generation.load();
+        if (m_count.fetch_add(1) + 1 == m_numThreads)
+        {
+            m_count.store(0);
+            m_generation.fetch_add(1);
+            return;
+        }
+
+        while (m_generation.load() == generation)
+        {
+            std::this_thread::yield();
+        }
+    }
+};
+
+struct Engine
+{
+    std::vector<LogicMatrix*> m_logicMatrices;
+    std::vector<LatticeExpander*> m_expanders;
+    std::vector<Module*> m_modules;
+    rack::engine::Module::ProcessArgs m_args;
+
+    Barrier m_startBarrier;
+    Barrier m_endBarrier;
+    std::atomic<size_t> m_nextModule;
+    std::atomic<bool> m_quit;
+    std::vector<std::thread> m_workers;
+
+    Engine(int numPairs, int numThreads)
+        : m_startBarrier(numThreads)
+        , m_endBarrier(numThreads)
+        , m_nextModule(0)
+        , m_quit(false)
+    {
+        m_args.sampleRate = x_sampleRate;
+        m_args.sampleTime = 1.f / x_sampleRate;
+        m_args.frame = 0;
+
+        TestRig::Lcg lcg;
+        for (int i = 0; i < numPairs; ++i)
+        {
+            LogicMatrix* logicMatrix = new LogicMatrix();
+            LatticeExpander* expander = new LatticeExpander();
+            logicMatrix->id = 2 * i;
+            logicMatrix->model = modelLogicMatrix;
+            expander->id = 2 * i + 1;
+            expander->model = modelLatticeExpander;
+            TestRig::Attach(logicMatrix, expander);
+
+            for (size_t j = 0; j < GetNumParams(); ++j)
+            {
+                logicMatrix->params[j].setValue(lcg.Below(3));
+            }
+
+            for (size_t j = 0; j < GetNumOutputs(); ++j)
+            {
+                TestRig::Patch(&logicMatrix->outputs[j], true);
+            }
+
+            TestRig::Patch(&logicMatrix->inputs[GetMainInputId(0)], true);
+            TestRig::Patch(&logicMatrix->inputs[GetMainInputId(1)], true);
+            TestRig::Patch(&logicMatrix->inputs[GetIntervalCVInputId(0)], true);
+            expander->ToggleCell(lcg.Below(3), lcg.Below(3));
+
+            m_logicMatrices.push_back(logicMatrix);
+            m_expanders.push_back(expander);
+            m_modules.push_back(logicMatrix);
+            m_modules.push_back(expander);
+        }
+
+        for (int i = 1; i < numThreads; ++i)
+        {
+            m_workers.push_back(std::thread([this]() { RunWorker(); }));
+        }
+    }
+
+    ~Engine()
+    {
+        m_quit.store(true);
+        m_startBarrier.Wait();
+        for (std::thread& worker : m_workers)
+        {
+            worker.join();
+        }
+
+        for (Module* module : m_modules)
+        {
+            delete module;
+        }
+    }
+
+    void RunWorker()
+    {
+        while (true)
+        {
+            m_startBarrier.Wait();
+            if (m_quit.load())
+            {
+                return;
+            }
+
+            StepModules();
+            m_endBarrier.Wait();
+        }
+    }
+
+    void StepModules()
+    {
+        while (true)
+        {
+            size_t i = m_nextModule.fetch_add(1);
+            if (i >= m_modules.size())
+            {
+                return;
+            }
+
+            m_modules[i]->process(m_args);
+        }
+    }
+
+    void SetInputs()
+    {
+        for (size_t i = 0; i < m_logicMatrices.size(); ++i)
+        {
+            LogicMatrix* logicMatrix = m_logicMatrices[i];
+            logicMatrix->inputs[GetMainInputId(0)].setVoltage((m_args.frame / (37 + i)) % 2 ? 5.f : 0.f);
+            logicMatrix->inputs[GetMainInputId(1)].setVoltage((m_args.frame / (101 + i)) % 2 ? 5.f : 0.f);
+            logicMatrix->inputs[GetIntervalCVInputId(0)].setVoltage(0.001f * (m_args.frame % 97));
+        }
+    }
+
+    // The calling thread is one of the workers, as Rack's engine thread is.
+    //
+    void StepFrame()
+    {
+        SetInputs();
+        m_nextModule.store(0);
+        m_startBarrier.Wait();
+        StepModules();
+        m_endBarrier.Wait();
+
+        for (Module* module : m_modules)
+        {
+            TestRig::FlipMessages(module);
+        }
+
+        ++m_args.frame;
+    }
+};
+
+static void Run(int numPairs, int numThreads, int numBlocks)
+{
+    Engine engine(numPairs, numThreads);
+
+    std::vector<double> blockMicros;
+    for (int i = 0; i < x_warmupBlocks + numBlocks; ++i)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int j = 0; j < x_blockSize; ++j)
+        {
+            engine.StepFrame();
+        }
+
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        if (i >= x_warmupBlocks)
+        {
+            blockMicros.push_back(elapsed.count());
+        }
+    }
+
+    std::sort(blockMicros.begin(), blockMicros.end());
+    double totalMicros = 0;
+    for (double micros : blockMicros)
+    {
+        totalMicros += micros;
+    }
+
+    double meanMicros = totalMicros / blockMicros.size();
+    double budgetMicros = 1e6 * x_blockSize / x_sampleRate;
+    double moduleSamplesPerSecond = 2.0 * numPairs * x_blockSize / (meanMicros * 1e-6);
+    printf("pairs %3d  threads %2d  mean %8.1fus  p50 %8.1fus  p99 %8.1fus  max %8.1fus  %6.1f%% of budget  %7.2fM module samples/s\n",
+           numPairs,
+           numThreads,
+           meanMicros,
+           blockMicros[blockMicros.size() / 2],
+           blockMicros[blockMicros.size() * 99 / 100],
+           blockMicros.back(),
+           100 * blockMicros[blockMicros.size() * 99 / 100] / budgetMicros,
+           moduleSamplesPerSecond / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+    BitKernels::Init();
+    printf("%d frames per block, %.0fus budget, %u hardware threads\n", x_blockSize, 1e6 * x_blockSize / x_sampleRate, std::thread::hardware_concurrency());
+
+    if (argc > 1)
+    {
+        int numPairs = std::max(1, atoi(argv[1]));
+        int numThreads = argc > 2 ? std::max(1, atoi(argv[2])) : 1;
+        int numBlocks = argc > 3 ? std::max(1, atoi(argv[3])) : x_defaultBlocks;
+        Run(numPairs, numThreads, numBlocks);
+        return 0;
+    }
+
+    static const int x_pairCounts[] = {1, 4, 16, 30, 64};
+    static const int x_threadCounts[] = {1, 2, 4, 8};
+    for (int numThreads : x_threadCounts)
+    {
+        for (int numPairs : x_pairCounts)
+        {
+            Run(numPairs, numThreads, x_defaultBlocks);
+        }
+    }
+
+    return 0;
+}
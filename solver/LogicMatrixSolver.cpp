@@ -0,0 +1,1021 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/LogicMatrixConstants.hpp"
+
+// Offline search for LogicMatrix settings that play a target sequence under the divide-by-two
+// clock, that is with only the first input patched (to the clock) and every other input normalled.
+// Searches the matrix switches, operation switches and operator knobs (and the interval knobs for
+// pitch targets), and writes the best settings found as Rack module presets, ranked by error.
+//
+//     LogicMatrixSolver [options] TARGET_FILE (or - for stdin)
+//
+//     --positions        Targets are lattice positions "x,y,z" (z may be left off).  The default.
+//     --pitches          Targets are pitches above the root, in semitones ("7") or as ratios ("3/2").
+//     --intervals a,b,c  Interval knob settings (0-8) to write into the presets for --positions.
+//     --results N        How many results to keep (default 10).
+//     --threads N        Worker threads (default all hardware threads).
+//     --seconds S        Stop searching after S seconds and report the best found so far
+//                        (default 300).
+//     --output PREFIX    Also write result i to PREFIX-i.vcvm.
+//
+// There is one target per step, and a step is each edge of the clock, starting from its first
+// rising edge.  "_" is a step that can be anything.  Steps past 64 see the same InputVectors again.
+//
+// Lattice positions don't depend on the voice, and an operation only counts towards the one
+// accumulator its switch picks, so each accumulator is searched on its own, for every number of
+// operations it could be given, and the best of those are combined.  Each search is a branch and
+// bound over multisets of compiled operation words (bit v is the operation's output on InputVector
+// v), spread over threads that steal work from each other.  Co-mute, percentile, the operator menu
+// and operation inputs are left at their defaults, which makes every voice play the lattice
+// position directly.
+//
+// Pitch targets are snapped to the nearest lattice position for every set of intervals, searched
+// as positions, and then ranked by their pitch error in cents.
+//
+// A search always stops at its time limit, five minutes unless --seconds says otherwise.  On a
+// single core, targets of 16 to 24 steps solve exactly in under half a second and 32 steps in up
+// to about eight seconds, but some 64-step targets don't finish within ten minutes and end at
+// the limit with the best found.  How the search scales with more threads has not been measured.
+//
+namespace SolverConstants
+{
+    using namespace LogicMatrixConstants;
+
+    static constexpr size_t x_numVectors = 1 << x_numInputs;
+    static constexpr size_t x_numSwitchSettings = 729 /*3^x_numInputs*/;
+    static constexpr size_t x_maxCount = x_numOperations;
+    static constexpr int x_dontCare = -1;
+
+    // Below this depth a search node is handed to the pool rather than searched in place, so idle
+    // threads have something to steal.
+    //
+    static constexpr size_t x_splitDepth = 2;
+    static constexpr size_t x_nodesPerDeadlineCheck = 1 << 12;
+    static constexpr size_t x_defaultNumResults = 10;
+    static constexpr double x_defaultSeconds = 300;
+
+    // MatrixElement::SwitchVal.
+    //
+    static constexpr uint8_t x_switchInverted = 0;
+    static constexpr uint8_t x_switchMuted = 1;
+};
+
+using namespace SolverConstants;
+
+// The InputVector on a step.  Input i > 0 is bit i - 1 of the count of rising clock edges, as in
+// LogicMatrix::InputStage::Process.
+//
+static uint8_t GetClockedVector(size_t step)
+{
+    size_t edges = step / 2 + 1;
+    return static_cast<uint8_t>((step % 2 == 0 ? 1 : 0) | ((edges << 1) & (x_numVectors - 1)));
+}
+
+static size_t CountSetBits(uint64_t bits)
+{
+    size_t count = 0;
+    for (; bits; bits &= bits - 1)
+    {
+        ++count;
+    }
+
+    return count;
+}
+
+// One operation's switches and knob, compiled to its output word.
+//
+struct OperationConfig
+{
+    uint8_t m_switches[x_numInputs];
+    uint8_t m_knob;
+    uint64_t m_word;
+};
+
+static std::vector<OperationConfig> CompileConfigs()
+{
+    std::vector<OperationConfig> configs;
+    for (size_t knob = 0; knob < x_numKnobOperators; ++knob)
+    {
+        for (size_t setting = 0; setting < x_numSwitchSettings; ++setting)
+        {
+            OperationConfig config;
+            config.m_knob = static_cast<uint8_t>(knob);
+            uint8_t active = 0;
+            uint8_t inverted = 0;
+            size_t digits = setting;
+            for (size_t j = 0; j < x_numInputs; ++j)
+            {
+                config.m_switches[j] = static_cast<uint8_t>(digits % 3);
+                digits /= 3;
+                active |= (config.m_switches[j] != x_switchMuted) << j;
+                inverted |= (config.m_switches[j] == x_switchInverted) << j;
+            }
+
+            config.m_word = 0;
+            for (size_t v = 0; v < x_numVectors; ++v)
+            {
+                if (GetKnobOperatorValue(knob, CountSetBits((v ^ inverted) & active), CountSetBits(active)))
+                {
+                    config.m_word |= uint64_t(1) << v;
+                }
+            }
+
+            configs.push_back(config);
+        }
+    }
+
+    return configs;
+}
+
+// Everything muted on OR is never high, which is what spare operations are set to.
+//
+static size_t GetIdleConfig(const std::vector<OperationConfig>& configs)
+{
+    for (size_t i = 0; i < configs.size(); ++i)
+    {
+        if (configs[i].m_word == 0)
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+// The best solutions with a given number of operations, shared between threads.  m_threshold is
+// the error a solution has to beat to get in, so searches can prune against it without the lock.
+//
+struct Results
+{
+    struct Solution
+    {
+        int m_error;
+        uint16_t m_words[x_numOperations];
+    };
+
+    std::mutex m_mutex;
+    std::vector<Solution> m_solutions;
+    std::atomic<int> m_threshold{INT_MAX};
+    size_t m_capacity = x_defaultNumResults;
+
+    void Offer(int error, const uint16_t* words)
+    {
+        if (error >= m_threshold.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Solution solution;
+        solution.m_error = error;
+        std::copy(words, words + x_numOperations, solution.m_words);
+        m_solutions.insert(
+            std::upper_bound(
+                m_solutions.begin(),
+                m_solutions.end(),
+                solution,
+                [](const Solution& a, const Solution& b) { return a.m_error < b.m_error; }),
+            solution);
+
+        if (m_solutions.size() >= m_capacity)
+        {
+            m_solutions.resize(m_capacity);
+            m_threshold.store(m_solutions.back().m_error, std::memory_order_relaxed);
+        }
+    }
+};
+
+// One accumulator's part of the target: how many of its operations should be high on each step.
+//
+struct Problem
+{
+    std::vector<int> m_targets;
+    uint64_t m_mask = 0;
+
+    // m_minCosts[v][c][r] is the least error on vector v from c operations high with r more to
+    // come, which is the bound searches prune with.  r = 0 is the actual error.
+    //
+    int m_minCosts[x_numVectors][x_maxCount + 1][x_maxCount + 1];
+
+    // Distinct words over the vectors that matter, best alone first, and a config for each.
+    //
+    std::vector<uint64_t> m_words;
+    std::vector<uint16_t> m_configs;
+
+    Results m_results[x_numOperations + 1];
+
+    void Init(const std::vector<int>& targets, const std::vector<OperationConfig>& configs, size_t numResults)
+    {
+        m_targets = targets;
+
+        int costs[x_numVectors][x_maxCount + 1] = {};
+        for (size_t s = 0; s < targets.size(); ++s)
+        {
+            if (targets[s] == x_dontCare)
+            {
+                continue;
+            }
+
+            uint8_t v = GetClockedVector(s);
+            m_mask |= uint64_t(1) << v;
+            for (size_t c = 0; c <= x_maxCount; ++c)
+            {
+                costs[v][c] += std::abs(targets[s] - static_cast<int>(c));
+            }
+        }
+
+        for (size_t v = 0; v < x_numVectors; ++v)
+        {
+            for (size_t c = 0; c <= x_maxCount; ++c)
+            {
+                for (size_t r = 0; r <= x_maxCount; ++r)
+                {
+                    int best = INT_MAX;
+                    for (size_t reached = c; reached <= std::min(c + r, x_maxCount); ++reached)
+                    {
+                        best = std::min(best, costs[v][reached]);
+                    }
+
+                    m_minCosts[v][c][r] = best;
+                }
+            }
+        }
+
+        std::map<uint64_t, uint16_t> distinct;
+        for (size_t i = 0; i < configs.size(); ++i)
+        {
+            uint64_t word = configs[i].m_word & m_mask;
+            if (word != 0 && distinct.find(word) == distinct.end())
+            {
+                distinct[word] = static_cast<uint16_t>(i);
+            }
+        }
+
+        std::vector<std::pair<int, uint64_t>> ranked;
+        for (const auto& entry : distinct)
+        {
+            int error = 0;
+            for (size_t v = 0; v < x_numVectors; ++v)
+            {
+                if ((m_mask >> v) & 1)
+                {
+                    error += m_minCosts[v][(entry.first >> v) & 1][0];
+                }
+            }
+
+            ranked.push_back(std::make_pair(error, entry.first));
+        }
+
+        std::sort(ranked.begin(), ranked.end());
+        for (const auto& entry : ranked)
+        {
+            m_words.push_back(entry.second);
+            m_configs.push_back(distinct[entry.second]);
+        }
+
+        for (Results& results : m_results)
+        {
+            results.m_capacity = numResults;
+        }
+    }
+};
+
+// A partial multiset of words for one problem.  Words are taken in non-decreasing index order, so
+// every multiset is reached once.  m_counts is a bit-sliced count of high operations per vector.
+//
+struct Node
+{
+    uint16_t m_problem = 0;
+    uint8_t m_depth = 0;
+    uint16_t m_next = 0;
+    uint16_t m_words[x_numOperations] = {};
+    uint64_t m_counts[3] = {};
+
+    void Add(uint16_t wordIndex, uint64_t word)
+    {
+        m_words[m_depth++] = wordIndex;
+        m_next = wordIndex;
+        uint64_t carry = word;
+        for (size_t b = 0; b < 3; ++b)
+        {
+            uint64_t sum = m_counts[b] ^ carry;
+            carry &= m_counts[b];
+            m_counts[b] = sum;
+        }
+    }
+
+    size_t GetCount(size_t v) const
+    {
+        return ((m_counts[0] >> v) & 1) | (((m_counts[1] >> v) & 1) << 1) | (((m_counts[2] >> v) & 1) << 2);
+    }
+};
+
+// Each thread works depth first off the back of its own deque and steals from the front of the
+// others' when it runs dry.  m_pending counts nodes pushed but not finished, so the search is over
+// when it reaches zero.
+//
+struct Solver
+{
+    struct Worker
+    {
+        std::mutex m_mutex;
+        std::deque<Node> m_nodes;
+    };
+
+    struct Child
+    {
+        int m_bound;
+        uint16_t m_index;
+    };
+
+    std::vector<std::unique_ptr<Problem>> m_problems;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t> m_pending{0};
+    std::atomic<uint64_t> m_numNodes{0};
+    std::atomic<bool> m_expired{false};
+    bool m_timedOut = false;
+    std::chrono::steady_clock::time_point m_deadline = std::chrono::steady_clock::time_point::max();
+
+    void Push(size_t workerId, const Node& node)
+    {
+        m_pending.fetch_add(1);
+        Worker& worker = *m_workers[workerId];
+        std::lock_guard<std::mutex> lock(worker.m_mutex);
+        worker.m_nodes.push_back(node);
+    }
+
+    bool Pop(size_t workerId, Node* node)
+    {
+        Worker& own = *m_workers[workerId];
+        {
+            std::lock_guard<std::mutex> lock(own.m_mutex);
+            if (!own.m_nodes.empty())
+            {
+                *node = own.m_nodes.back();
+                own.m_nodes.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_workers.size(); ++i)
+        {
+            Worker& victim = *m_workers[(workerId + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(victim.m_mutex);
+            if (!victim.m_nodes.empty())
+            {
+                *node = victim.m_nodes.front();
+                victim.m_nodes.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Search(size_t workerId, const Node& node, size_t* numNodes)
+    {
+        if (m_expired.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+
+        if (++*numNodes % x_nodesPerDeadlineCheck == 0 && std::chrono::steady_clock::now() > m_deadline)
+        {
+            m_expired.store(true);
+            return;
+        }
+
+        Problem& problem = *m_problems[node.m_problem];
+        size_t remaining = x_numOperations - node.m_depth;
+
+        // A solution is only worth keeping if it beats the ones with as many operations or fewer,
+        // since spare operations can always be left idle.
+        //
+        int thresholds[x_numOperations + 1];
+        int threshold = INT_MAX;
+        for (size_t n = 0; n <= x_numOperations; ++n)
+        {
+            threshold = std::min(threshold, problem.m_results[n].m_threshold.load(std::memory_order_relaxed));
+            thresholds[n] = threshold;
+        }
+
+        // bounds[r] is the least error reachable with r more words.
+        //
+        int bounds[x_numOperations + 1] = {};
+        for (uint64_t mask = problem.m_mask; mask; mask &= mask - 1)
+        {
+            size_t v = __builtin_ctzll(mask);
+            const int* minCosts = problem.m_minCosts[v][node.GetCount(v)];
+            for (size_t r = 0; r <= remaining; ++r)
+            {
+                bounds[r] += minCosts[r];
+            }
+        }
+
+        if (bounds[0] < thresholds[node.m_depth])
+        {
+            problem.m_results[node.m_depth].Offer(bounds[0], node.m_words);
+        }
+
+        bool promising = false;
+        for (size_t r = 1; r <= remaining; ++r)
+        {
+            promising |= bounds[r] < thresholds[node.m_depth + r];
+        }
+
+        if (!promising)
+        {
+            return;
+        }
+
+        // The best any child can end up with is its bound with every remaining word still to come.
+        // That is this node's bound plus a delta per vector the child's word is high on, so
+        // children are bounded without walking their words, and tried best first.
+        //
+        int deltas[x_numVectors] = {};
+        for (uint64_t mask = problem.m_mask; mask; mask &= mask - 1)
+        {
+            size_t v = __builtin_ctzll(mask);
+            size_t count = node.GetCount(v);
+            deltas[v] = problem.m_minCosts[v][count + 1][remaining - 1] - problem.m_minCosts[v][count][remaining - 1];
+        }
+
+        int base = 0;
+        for (uint64_t mask = problem.m_mask; mask; mask &= mask - 1)
+        {
+            size_t v = __builtin_ctzll(mask);
+            base += problem.m_minCosts[v][node.GetCount(v)][remaining - 1];
+        }
+
+        // One list per depth and thread, reused so the search doesn't allocate.
+        //
+        static thread_local std::vector<Child> t_children[x_numOperations];
+        std::vector<Child>& children = t_children[node.m_depth];
+        children.clear();
+        for (size_t i = node.m_next; i < problem.m_words.size(); ++i)
+        {
+            int bound = base;
+            for (uint64_t word = problem.m_words[i]; word; word &= word - 1)
+            {
+                bound += deltas[__builtin_ctzll(word)];
+            }
+
+            if (bound < thresholds[node.m_depth + 1])
+            {
+                children.push_back(Child{bound, static_cast<uint16_t>(i)});
+            }
+        }
+
+        std::stable_sort(children.begin(), children.end(), [](const Child& a, const Child& b) { return a.m_bound < b.m_bound; });
+
+        // Pushed worst first, since the owner pops from the back.
+        //
+        if (node.m_depth < x_splitDepth)
+        {
+            for (size_t i = children.size(); i-- > 0;)
+            {
+                Node child = node;
+                child.Add(children[i].m_index, problem.m_words[children[i].m_index]);
+                Push(workerId, child);
+            }
+
+            return;
+        }
+
+        for (size_t i = 0; i < children.size(); ++i)
+        {
+            Node child = node;
+            child.Add(children[i].m_index, problem.m_words[children[i].m_index]);
+            Search(workerId, child, numNodes);
+        }
+    }
+
+    void WorkLoop(size_t workerId)
+    {
+        size_t numNodes = 0;
+        Node node;
+        while (true)
+        {
+            if (Pop(workerId, &node))
+            {
+                Search(workerId, node, &numNodes);
+                m_pending.fetch_sub(1);
+            }
+            else if (m_pending.load() == 0)
+            {
+                break;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        m_numNodes.fetch_add(numNodes);
+    }
+
+    // Problems are solved one after another, all threads on each, so a time limit is shared out
+    // between them.  Time a problem doesn't use goes to the ones after it.
+    //
+    void Run(size_t numThreads, double seconds)
+    {
+        for (size_t i = 0; i < numThreads; ++i)
+        {
+            m_workers.emplace_back(new Worker());
+        }
+
+        std::chrono::steady_clock::time_point end =
+            std::chrono::steady_clock::now() + std::chrono::microseconds(static_cast<int64_t>(seconds * 1e6));
+        for (size_t i = 0; i < m_problems.size(); ++i)
+        {
+            m_deadline = std::chrono::steady_clock::now() + (end - std::chrono::steady_clock::now()) / static_cast<int>(m_problems.size() - i);
+
+            m_timedOut |= m_expired.exchange(false);
+
+            Node root;
+            root.m_problem = static_cast<uint16_t>(i);
+            Push(0, root);
+
+            std::vector<std::thread> threads;
+            for (size_t j = 0; j < numThreads; ++j)
+            {
+                threads.emplace_back([this, j]() { WorkLoop(j); });
+            }
+
+            for (std::thread& thread : threads)
+            {
+                thread.join();
+            }
+        }
+
+        m_timedOut |= m_expired.exchange(false);
+    }
+};
+
+// A full setting: which operations go to which accumulator with which config.
+//
+struct Candidate
+{
+    int m_latticeError = 0;
+    double m_centsError = 0;
+    uint8_t m_intervals[x_numAccumulators] = {};
+    bool m_hasIntervals = false;
+    uint16_t m_configs[x_numOperations] = {};
+    uint8_t m_targets[x_numOperations] = {};
+};
+
+// The best combinations of each accumulator's results, over every split of the operations.
+//
+static void CombineResults(Problem* const* problems, size_t idleConfig, size_t numResults, std::vector<Candidate>* candidates)
+{
+    typedef Results::Solution Solution;
+
+    for (size_t n0 = 0; n0 <= x_numOperations; ++n0)
+    {
+        for (size_t n1 = 0; n0 + n1 <= x_numOperations; ++n1)
+        {
+            for (size_t n2 = 0; n0 + n1 + n2 <= x_numOperations; ++n2)
+            {
+                size_t counts[] = {n0, n1, n2};
+                const std::vector<Solution>* lists[x_numAccumulators];
+                bool empty = false;
+                for (size_t a = 0; a < x_numAccumulators; ++a)
+                {
+                    lists[a] = &problems[a]->m_results[counts[a]].m_solutions;
+                    empty |= lists[a]->empty();
+                }
+
+                if (empty)
+                {
+                    continue;
+                }
+
+                for (size_t i = 0; i < std::min(lists[0]->size(), numResults); ++i)
+                {
+                    for (size_t j = 0; j < std::min(lists[1]->size(), numResults); ++j)
+                    {
+                        for (size_t k = 0; k < std::min(lists[2]->size(), numResults); ++k)
+                        {
+                            const Solution* solutions[] = {&(*lists[0])[i], &(*lists[1])[j], &(*lists[2])[k]};
+                            Candidate candidate;
+                            size_t operationId = 0;
+                            for (size_t a = 0; a < x_numAccumulators; ++a)
+                            {
+                                candidate.m_latticeError += solutions[a]->m_error;
+                                for (size_t w = 0; w < counts[a]; ++w)
+                                {
+                                    candidate.m_configs[operationId] = problems[a]->m_configs[solutions[a]->m_words[w]];
+                                    candidate.m_targets[operationId] = static_cast<uint8_t>(a);
+                                    ++operationId;
+                                }
+                            }
+
+                            for (; operationId < x_numOperations; ++operationId)
+                            {
+                                candidate.m_configs[operationId] = static_cast<uint16_t>(idleConfig);
+                                candidate.m_targets[operationId] = 0;
+                            }
+
+                            candidates->push_back(candidate);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static double GetPositionPitch(const uint8_t* intervals, const int* position)
+{
+    double pitch = 0;
+    for (size_t a = 0; a < x_numAccumulators; ++a)
+    {
+        pitch += x_intervalVoltages[intervals[a]] * position[a];
+    }
+
+    return pitch;
+}
+
+// The position nearest the pitch, with the fewest operations high on a tie.
+//
+static void SnapPitch(const uint8_t* intervals, double pitch, int* position)
+{
+    double bestError = INFINITY;
+    int bestTotal = INT_MAX;
+    for (int x = 0; x <= static_cast<int>(x_maxCount); ++x)
+    {
+        for (int y = 0; x + y <= static_cast<int>(x_maxCount); ++y)
+        {
+            for (int z = 0; x + y + z <= static_cast<int>(x_maxCount); ++z)
+            {
+                int candidate[] = {x, y, z};
+                double error = std::abs(GetPositionPitch(intervals, candidate) - pitch);
+                if (error < bestError - 1e-9 || (error < bestError + 1e-9 && x + y + z < bestTotal))
+                {
+                    bestError = error;
+                    bestTotal = x + y + z;
+                    std::copy(candidate, candidate + x_numAccumulators, position);
+                }
+            }
+        }
+    }
+}
+
+// The pitch error of a candidate, from the positions its words actually reach.
+//
+static double GetCentsError(const Candidate& candidate, const std::vector<OperationConfig>& configs, const std::vector<double>& pitches)
+{
+    double error = 0;
+    for (size_t s = 0; s < pitches.size(); ++s)
+    {
+        if (std::isnan(pitches[s]))
+        {
+            continue;
+        }
+
+        uint8_t v = GetClockedVector(s);
+        int position[x_numAccumulators] = {};
+        for (size_t i = 0; i < x_numOperations; ++i)
+        {
+            position[candidate.m_targets[i]] += (configs[candidate.m_configs[i]].m_word >> v) & 1;
+        }
+
+        error += 1200 * std::abs(GetPositionPitch(candidate.m_intervals, position) - pitches[s]);
+    }
+
+    return error;
+}
+
+static void WritePreset(FILE* file, const Candidate& candidate, const std::vector<OperationConfig>& configs)
+{
+    std::fprintf(file, "{\"plugin\":\"LogicMatrix\",\"model\":\"LogicMatrix\",\"version\":\"2.0.0\",\"params\":[");
+
+    bool first = true;
+    auto writeParam = [&](size_t id, int value)
+    {
+        std::fprintf(file, "%s{\"id\":%zu,\"value\":%d}", first ? "" : ",", id, value);
+        first = false;
+    };
+
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        const OperationConfig& config = configs[candidate.m_configs[i]];
+        for (size_t j = 0; j < x_numInputs; ++j)
+        {
+            writeParam(GetMatrixSwitchId(j, i), config.m_switches[j]);
+        }
+
+        // Up is accumulator zero but switch value 2.
+        //
+        writeParam(GetOperationSwitchId(i), static_cast<int>(x_numAccumulators - candidate.m_targets[i] - 1));
+        writeParam(GetOperatorKnobId(i), config.m_knob);
+    }
+
+    for (size_t a = 0; a < x_numAccumulators; ++a)
+    {
+        for (size_t j = 0; j < x_numInputs; ++j)
+        {
+            writeParam(GetPitchCoMuteSwitchId(j, a), 1);
+        }
+
+        if (candidate.m_hasIntervals)
+        {
+            writeParam(GetAccumulatorIntervalKnobId(a), candidate.m_intervals[a]);
+        }
+    }
+
+    std::fprintf(file, "],\"data\":{\"chainMode\":0,\"selections\":[0,0,0],\"operators\":[");
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        std::fprintf(
+            file,
+            "%s{\"type\":0,\"k\":1,\"truthTable\":\"0000000000000000\",\"operationInputs\":0}",
+            i == 0 ? "" : ",");
+    }
+
+    std::fprintf(file, "]}}");
+}
+
+static bool ParseTargets(FILE* file, bool pitches, std::vector<std::vector<int>>* positions, std::vector<double>* pitchTargets)
+{
+    char token[64];
+    while (std::fscanf(file, "%63s", token) == 1)
+    {
+        if (std::strcmp(token, "_") == 0)
+        {
+            positions->push_back(std::vector<int>(x_numAccumulators, x_dontCare));
+            pitchTargets->push_back(NAN);
+        }
+        else if (pitches)
+        {
+            const char* slash = std::strchr(token, '/');
+            double pitch = slash ? std::log2(std::atof(token) / std::atof(slash + 1)) : std::atof(token) / 12;
+            pitchTargets->push_back(pitch);
+        }
+        else
+        {
+            std::vector<int> position(x_numAccumulators, 0);
+            if (std::sscanf(token, "%d,%d,%d", &position[0], &position[1], &position[2]) < 2)
+            {
+                std::fprintf(stderr, "Bad position \"%s\", expected x,y or x,y,z\n", token);
+                return false;
+            }
+
+            positions->push_back(position);
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    bool pitches = false;
+    bool hasIntervals = false;
+    uint8_t intervals[x_numAccumulators] = {};
+    size_t numResults = x_defaultNumResults;
+    size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    double seconds = x_defaultSeconds;
+    std::string outputPrefix;
+    std::string targetPath;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--pitches")
+        {
+            pitches = true;
+        }
+        else if (arg == "--positions")
+        {
+            pitches = false;
+        }
+        else if (arg == "--intervals" && hasValue)
+        {
+            int values[x_numAccumulators] = {};
+            if (std::sscanf(argv[++i], "%d,%d,%d", &values[0], &values[1], &values[2]) != 3)
+            {
+                std::fprintf(stderr, "Expected --intervals a,b,c\n");
+                return 1;
+            }
+
+            for (size_t a = 0; a < x_numAccumulators; ++a)
+            {
+                intervals[a] = static_cast<uint8_t>(std::min(std::max(values[a], 0), static_cast<int>(x_numIntervals) - 1));
+            }
+
+            hasIntervals = true;
+        }
+        else if (arg == "--results" && hasValue)
+        {
+            numResults = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--threads" && hasValue)
+        {
+            numThreads = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--seconds" && hasValue)
+        {
+            double value = std::atof(argv[++i]);
+            seconds = value > 0 ? value : x_defaultSeconds;
+        }
+        else if (arg == "--output" && hasValue)
+        {
+            outputPrefix = argv[++i];
+        }
+        else
+        {
+            targetPath = arg;
+        }
+    }
+
+    FILE* targetFile = targetPath == "-" ? stdin : std::fopen(targetPath.c_str(), "r");
+    if (!targetFile)
+    {
+        std::fprintf(stderr, "Usage: %s [--positions | --pitches] [--intervals a,b,c] [--results N] [--threads N] [--seconds S] [--output PREFIX] TARGET_FILE\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<std::vector<int>> positions;
+    std::vector<double> pitchTargets;
+    bool parsed = ParseTargets(targetFile, pitches, &positions, &pitchTargets);
+    if (targetFile != stdin)
+    {
+        std::fclose(targetFile);
+    }
+
+    if (!parsed || (positions.empty() && pitchTargets.empty()))
+    {
+        std::fprintf(stderr, "No targets\n");
+        return 1;
+    }
+
+    std::vector<OperationConfig> configs = CompileConfigs();
+    size_t idleConfig = GetIdleConfig(configs);
+
+    // Interval settings to try, each with the targets per accumulator.  Swapping two accumulators
+    // along with their operations changes nothing, so pitch targets only try sorted intervals.
+    //
+    struct Setting
+    {
+        uint8_t m_intervals[x_numAccumulators];
+        size_t m_problems[x_numAccumulators];
+    };
+
+    Solver solver;
+    std::map<std::vector<int>, size_t> problemIds;
+    std::vector<Setting> settings;
+    auto addProblem = [&](const std::vector<int>& targets)
+    {
+        auto it = problemIds.find(targets);
+        if (it != problemIds.end())
+        {
+            return it->second;
+        }
+
+        solver.m_problems.emplace_back(new Problem());
+        solver.m_problems.back()->Init(targets, configs, numResults);
+        problemIds[targets] = solver.m_problems.size() - 1;
+        return solver.m_problems.size() - 1;
+    };
+
+    size_t numSteps = pitches ? pitchTargets.size() : positions.size();
+    for (size_t i0 = 0; i0 < (pitches ? x_numIntervals : 1); ++i0)
+    {
+        for (size_t i1 = i0; i1 < (pitches ? x_numIntervals : 1); ++i1)
+        {
+            for (size_t i2 = i1; i2 < (pitches ? x_numIntervals : 1); ++i2)
+            {
+                Setting setting;
+                setting.m_intervals[0] = pitches ? static_cast<uint8_t>(i0) : intervals[0];
+                setting.m_intervals[1] = pitches ? static_cast<uint8_t>(i1) : intervals[1];
+                setting.m_intervals[2] = pitches ? static_cast<uint8_t>(i2) : intervals[2];
+
+                std::vector<std::vector<int>> targets(x_numAccumulators, std::vector<int>(numSteps, x_dontCare));
+                for (size_t s = 0; s < numSteps; ++s)
+                {
+                    int position[x_numAccumulators];
+                    if (pitches)
+                    {
+                        if (std::isnan(pitchTargets[s]))
+                        {
+                            continue;
+                        }
+
+                        SnapPitch(setting.m_intervals, pitchTargets[s], position);
+                    }
+                    else
+                    {
+                        std::copy(positions[s].begin(), positions[s].end(), position);
+                    }
+
+                    for (size_t a = 0; a < x_numAccumulators; ++a)
+                    {
+                        targets[a][s] = position[a];
+                    }
+                }
+
+                for (size_t a = 0; a < x_numAccumulators; ++a)
+                {
+                    setting.m_problems[a] = addProblem(targets[a]);
+                }
+
+                settings.push_back(setting);
+            }
+        }
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    solver.Run(numThreads, seconds);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::fprintf(
+        stderr,
+        "Searched %zu accumulator problems, %llu nodes, in %.2f s on %zu threads%s\n",
+        solver.m_problems.size(),
+        static_cast<unsigned long long>(solver.m_numNodes.load()),
+        elapsed,
+        numThreads,
+        solver.m_timedOut ? " (stopped at the time limit, results are the best found)" : "");
+
+    // Only the best few are kept between settings.
+    //
+    auto better = [](const Candidate& a, const Candidate& b)
+    {
+        return a.m_centsError != b.m_centsError ? a.m_centsError < b.m_centsError : a.m_latticeError < b.m_latticeError;
+    };
+
+    std::vector<Candidate> candidates;
+    for (const Setting& setting : settings)
+    {
+        Problem* problems[x_numAccumulators];
+        for (size_t a = 0; a < x_numAccumulators; ++a)
+        {
+            problems[a] = solver.m_problems[setting.m_problems[a]].get();
+        }
+
+        size_t first = candidates.size();
+        CombineResults(problems, idleConfig, numResults, &candidates);
+        for (size_t i = first; i < candidates.size(); ++i)
+        {
+            std::copy(setting.m_intervals, setting.m_intervals + x_numAccumulators, candidates[i].m_intervals);
+            candidates[i].m_hasIntervals = pitches || hasIntervals;
+            if (pitches)
+            {
+                candidates[i].m_centsError = GetCentsError(candidates[i], configs, pitchTargets);
+            }
+        }
+
+        std::sort(candidates.begin(), candidates.end(), better);
+        candidates.resize(std::min(candidates.size(), numResults));
+    }
+
+    std::printf("[");
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        const Candidate& candidate = candidates[i];
+        std::printf(
+            "%s\n{\"rank\":%zu,\"latticeError\":%d,",
+            i == 0 ? "" : ",",
+            i + 1,
+            candidate.m_latticeError);
+        if (pitches)
+        {
+            std::printf("\"centsError\":%.1f,", candidate.m_centsError);
+        }
+
+        std::printf("\"preset\":");
+        WritePreset(stdout, candidate, configs);
+        std::printf("}");
+
+        if (!outputPrefix.empty())
+        {
+            std::string path = outputPrefix + "-" + std::to_string(i + 1) + ".vcvm";
+            FILE* file = std::fopen(path.c_str(), "w");
+            if (file)
+            {
+                WritePreset(file, candidate, configs);
+                std::fputs("\n", file);
+                std::fclose(file);
+            }
+        }
+    }
+
+    std::printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "BitKernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BIT_KERNELS_X86 1
+#endif
+
+namespace BitKernels
+{
+    static const uint8_t x_bitsSet [16] =
+    {
+        0, 1, 1, 2, 1, 2, 2, 3, 
+        1, 2, 2, 3, 2, 3, 3, 4
+    };
+
+    static size_t CountSetBitsPortable(uint8_t bits)
+    {
+        return x_bitsSet[bits & 0x0F] + x_bitsSet[bits >> 4];
+    }
+
+    // (subset - mask) & mask steps through the subsets of mask in increasing order, which is
+    // the same order as scattering 0, 1, 2, ... into the set bits of mask.
+    //
+    static size_t ExpandCoMuteSetPortable(uint8_t coMuteBits, uint8_t defaultBits, uint8_t* out)
+    {
+        uint8_t base = defaultBits & ~coMuteBits;
+        size_t count = 0;
+        uint8_t subset = 0;
+        do
+        {
+            out[count++] = base | subset;
+            subset = (subset - coMuteBits) & coMuteBits;
+        }
+        while (subset != 0);
+
+        return count;
+    }
+
+#ifdef BIT_KERNELS_X86
+    __attribute__((target("popcnt")))
+    static size_t CountSetBitsPopcnt(uint8_t bits)
+    {
+        return __builtin_popcount(bits);
+    }
+
+    __attribute__((target("bmi2,popcnt")))
+    static size_t ExpandCoMuteSetBmi2(uint8_t coMuteBits, uint8_t defaultBits, uint8_t* out)
+    {
+        uint32_t base = defaultBits & ~coMuteBits;
+        uint32_t count = 1u << __builtin_popcount(coMuteBits);
+        for (uint32_t ordinal = 0; ordinal < count; ++ordinal)
+        {
+            out[ordinal] = static_cast<uint8_t>(base | _pdep_u32(ordinal, coMuteBits));
+        }
+
+        return count;
+    }
+#endif
+
+    CountSetBitsFn g_countSetBits = CountSetBitsPortable;
+    ExpandCoMuteSetFn g_expandCoMuteSet = ExpandCoMuteSetPortable;
+    static const char* s_kernelName = "portable";
+
+    void Init()
+    {
+#ifdef BIT_KERNELS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("popcnt"))
+        {
+            g_countSetBits = CountSetBitsPopcnt;
+            s_kernelName = "popcnt";
+
+            // PDEP is microcoded and very slow on AMD before Zen 3, so stick with the subset walk there.
+            //
+            if (__builtin_cpu_supports("bmi2") &&
+                !__builtin_cpu_is("znver1") &&
+                !__builtin_cpu_is("znver2"))
+            {
+                g_expandCoMuteSet = ExpandCoMuteSetBmi2;
+                s_kernelName = "popcnt+bmi2";
+            }
+        }
+#endif
+    }
+
+    const char* GetKernelName()
+    {
+        return s_kernelName;
+    }
+}
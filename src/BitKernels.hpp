@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Small bit-twiddling kernels used by the matrix evaluation, picked once at plugin load.
+// On x86 machines with BMI2 and POPCNT the hardware instructions are used, otherwise a
+// portable version is.  Nothing has to be built with a special -march.
+//
+namespace BitKernels
+{
+    // Number of set bits.
+    //
+    typedef size_t (*CountSetBitsFn)(uint8_t bits);
+
+    // Writes every vector that agrees with defaultBits outside of coMuteBits, in order of the
+    // ordinal whose bits are scattered into the co-muted positions.  Returns how many were written,
+    // which is 1 << popcount(coMuteBits).
+    //
+    typedef size_t (*ExpandCoMuteSetFn)(uint8_t coMuteBits, uint8_t defaultBits, uint8_t* out);
+
+    extern CountSetBitsFn g_countSetBits;
+    extern ExpandCoMuteSetFn g_expandCoMuteSet;
+
+    void Init();
+    const char* GetKernelName();
+}
@@ -0,0 +1,261 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Opt-in edge-to-output latency measurement.  An edge is a patched input crossing its threshold,
+// stamped by the input stage before normalling and chaining, or a change in the bits chained in
+// from the left.  Each output path then counts the samples until it next changes.  Counts go into
+// one histogram per path, written out as JSON when measurement stops.
+//
+// Timestamps are Rack's engine frame, which every module sees the same value of within a sample,
+// so the LatticeExpander measures its own hop from the edge frame carried in its message.
+//
+namespace Latency
+{
+    enum class Path : uint8_t
+    {
+        LogicOut = 0,
+        PitchOut = 1,
+        Trigger = 2,
+        LatticeMessage = 3,
+        LatticeLights = 4,
+        NumPaths = 5
+    };
+
+    static constexpr size_t x_numPaths = static_cast<size_t>(Path::NumPaths);
+
+    static constexpr const char* x_pathNames[] = {
+        "LogicOut",
+        "PitchOut",
+        "Trigger",
+        "LatticeMessage",
+        "LatticeLights"
+    };
+
+    // What each path should take, in samples.  The report counts everything outside these as
+    // unexpected, so a harness comparing reports can fail when timing changes.  The lattice only
+    // looks at its message on light division ticks, so its lights may take up to a division more.
+    //
+    static constexpr int64_t x_expectedMinFrames[] = {0, 0, 0, 1, 1};
+    static constexpr int64_t x_expectedMaxFrames[] = {0, 0, 0, 1, 1};
+    static constexpr size_t x_lightDivisionSlack[] = {0, 0, 0, 0, 1};
+
+    // Enough for the longest light division.  Anything later lands in the last bin.
+    //
+    static constexpr size_t x_numBins = 512;
+
+    struct Meter
+    {
+        std::atomic<bool> m_enabled;
+        std::atomic<uint32_t> m_counts[x_numPaths][x_numBins];
+        std::atomic<uint32_t> m_numEdges;
+
+        // Only touched by the audio thread.  m_pendingEdge is the edge each path is waiting to
+        // respond to, or -1 once it has.  A path that doesn't change before the next edge is
+        // measured from that one instead, so it never takes the blame for an edge it ignored.
+        //
+        bool m_running = false;
+        int64_t m_lastEdge = -1;
+        int64_t m_pendingEdge[x_numPaths];
+        uint64_t m_lastValues[x_numPaths];
+        uint64_t m_lastInput = 0;
+        uint32_t m_primed = 0;
+
+        Meter()
+            : m_enabled(false)
+            , m_numEdges(0)
+        {
+            Clear();
+        }
+
+        bool IsEnabled()
+        {
+            return m_enabled.load(std::memory_order_relaxed);
+        }
+
+        // Called once a sample, before anything else here.  The first sample after starting
+        // only primes the last values, since there is nothing to compare them with.
+        //
+        bool Begin()
+        {
+            if (!IsEnabled())
+            {
+                m_running = false;
+                return false;
+            }
+
+            if (!m_running)
+            {
+                m_running = true;
+                m_lastEdge = -1;
+                m_primed = 0;
+                std::fill(m_pendingEdge, m_pendingEdge + x_numPaths, -1);
+            }
+
+            return true;
+        }
+
+        void OnEdge(int64_t frame)
+        {
+            m_lastEdge = frame;
+            m_numEdges.fetch_add(1, std::memory_order_relaxed);
+            std::fill(m_pendingEdge, m_pendingEdge + x_numPaths, frame);
+        }
+
+        void ObserveInput(int64_t frame, uint64_t value)
+        {
+            static constexpr uint32_t x_inputBit = 1 << x_numPaths;
+            if (!(m_primed & x_inputBit))
+            {
+                m_primed |= x_inputBit;
+                m_lastInput = value;
+            }
+            else if (value != m_lastInput)
+            {
+                m_lastInput = value;
+                OnEdge(frame);
+            }
+        }
+
+        // The path changed on this frame.
+        //
+        void OnChange(Path path, int64_t frame)
+        {
+            size_t p = static_cast<size_t>(path);
+            if (m_pendingEdge[p] >= 0)
+            {
+                size_t bin = static_cast<size_t>(std::min<int64_t>(frame - m_pendingEdge[p], x_numBins - 1));
+                m_counts[p][bin].fetch_add(1, std::memory_order_relaxed);
+                m_pendingEdge[p] = -1;
+            }
+        }
+
+        void Observe(Path path, int64_t frame, uint64_t value)
+        {
+            size_t p = static_cast<size_t>(path);
+            if (!(m_primed & (1 << p)))
+            {
+                m_primed |= 1 << p;
+                m_lastValues[p] = value;
+            }
+            else if (value != m_lastValues[p])
+            {
+                m_lastValues[p] = value;
+                OnChange(path, frame);
+            }
+        }
+
+        void Clear()
+        {
+            for (size_t i = 0; i < x_numPaths; ++i)
+            {
+                for (size_t j = 0; j < x_numBins; ++j)
+                {
+                    m_counts[i][j].store(0, std::memory_order_relaxed);
+                }
+            }
+
+            m_numEdges.store(0, std::memory_order_relaxed);
+        }
+
+        // Called from the UI thread.
+        //
+        void Start()
+        {
+            Clear();
+            m_enabled.store(true, std::memory_order_release);
+        }
+
+        // Called from the UI thread.
+        //
+        void Stop()
+        {
+            m_enabled.store(false, std::memory_order_release);
+        }
+    };
+
+    inline int64_t GetExpectedMaxFrames(size_t path, uint32_t lightDivision)
+    {
+        return x_expectedMaxFrames[path] + static_cast<int64_t>(x_lightDivisionSlack[path] * (lightDivision - 1));
+    }
+
+    // One path's histogram, added up over the meters.
+    //
+    struct Summary
+    {
+        uint32_t m_counts[x_numBins];
+        uint32_t m_total = 0;
+        uint32_t m_unexpected = 0;
+
+        Summary(Meter* const* meters, size_t numMeters, size_t path, uint32_t lightDivision)
+        {
+            int64_t expectedMax = GetExpectedMaxFrames(path, lightDivision);
+            for (size_t i = 0; i < x_numBins; ++i)
+            {
+                m_counts[i] = 0;
+                for (size_t j = 0; j < numMeters; ++j)
+                {
+                    m_counts[i] += meters[j]->m_counts[path][i].load();
+                }
+
+                m_total += m_counts[i];
+                if (static_cast<int64_t>(i) < x_expectedMinFrames[path] || static_cast<int64_t>(i) > expectedMax)
+                {
+                    m_unexpected += m_counts[i];
+                }
+            }
+        }
+    };
+
+    // Called from the UI thread, after stopping.  The meters' histograms are added together, so
+    // the LogicMatrix and its LatticeExpander, which each fill different paths, share one report.
+    //
+    inline bool WriteReport(const std::string& path, Meter* const* meters, size_t numMeters, uint32_t lightDivision, float sampleRate)
+    {
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file)
+        {
+            return false;
+        }
+
+        std::fprintf(
+            file,
+            "{\"sampleRate\":%g,\"lightDivision\":%u,\"edges\":%u,\"paths\":{",
+            sampleRate,
+            static_cast<unsigned>(lightDivision),
+            static_cast<unsigned>(meters[0]->m_numEdges.load()));
+
+        for (size_t i = 0; i < x_numPaths; ++i)
+        {
+            Summary summary(meters, numMeters, i, lightDivision);
+            std::fprintf(
+                file,
+                "%s\n\"%s\":{\"expected\":[%lld,%lld],\"histogram\":{",
+                i == 0 ? "" : ",",
+                x_pathNames[i],
+                static_cast<long long>(x_expectedMinFrames[i]),
+                static_cast<long long>(GetExpectedMaxFrames(i, lightDivision)));
+
+            bool first = true;
+            for (size_t j = 0; j < x_numBins; ++j)
+            {
+                if (summary.m_counts[j] == 0)
+                {
+                    continue;
+                }
+
+                std::fprintf(file, "%s\"%s%zu\":%u", first ? "" : ",", j == x_numBins - 1 ? ">=" : "", j, static_cast<unsigned>(summary.m_counts[j]));
+                first = false;
+            }
+
+            std::fprintf(file, "},\"count\":%u,\"unexpected\":%u}", static_cast<unsigned>(summary.m_total), static_cast<unsigned>(summary.m_unexpected));
+        }
+
+        std::fputs("\n}}\n", file);
+        std::fclose(file);
+        return true;
+    }
+}
@@ -3,15 +3,41 @@
 #include <cstddef>
 #include "LogicMatrixConstants.hpp"
 #include "Lattice.hpp"
+#include "Trace.hpp"
+#include "Latency.hpp"
+#include "Snapshot.hpp"
 
 struct LatticeExpanderMessage
 {
     int m_intervalSemitones[LogicMatrixConstants::x_numAccumulators];
     int m_position[LogicMatrixConstants::x_numAccumulators][LogicMatrixConstants::x_numAccumulators];
+    uint32_t m_lightDivision;
+    uint8_t m_inputVector;
+
+    // The engine frame of the latest input edge while the LogicMatrix is measuring latency,
+    // otherwise -1.
+    //
+    int64_t m_edgeFrame;
 
     LatticeExpanderMessage()
     {
         memset(this, 0, sizeof(LatticeExpanderMessage));
+        m_edgeFrame = -1;
+    }
+};
+
+// Sent back from a LatticeExpander to the LogicMatrix on its left.
+//
+struct LatticeMaskMessage
+{
+    // Per voice, bit GetCellBit(x, y) is set if the voice may land on that cell.
+    // Zero means the voice is not filtered at all.
+    //
+    uint64_t m_cellMasks[LogicMatrixConstants::x_numAccumulators];
+
+    LatticeMaskMessage()
+    {
+        memset(this, 0, sizeof(LatticeMaskMessage));
     }
 };
 
@@ -21,6 +47,18 @@ namespace LatticeExpanderConstants
 {
     static constexpr size_t x_gridSize = 6;
 
+    static constexpr size_t GetCellBit(size_t x, size_t y)
+    {
+        return x * x_gridSize + y;
+    }
+
+    // Each voice leaves a trail over the last x_trailLength cells it has left, each fading out
+    // over x_trailFadeSeconds.  Fades are stepped every x_trailFadeDivision samples.
+    //
+    static constexpr size_t x_trailLength = 8;
+    static constexpr float x_trailFadeSeconds = 1.5;
+    static constexpr uint32_t x_trailFadeDivision = 256;
+
     enum class LightColor : int
     {
         Red = 0,
@@ -44,35 +82,76 @@ namespace LatticeExpanderConstants
         return 0;
     }
 
-    enum class LightType : int
+    // The lattice is drawn by one custom widget, so there are no Rack lights.
+    //
+    static constexpr size_t GetNumLights()
     {
-        LatticeLight = 0,
-        NumLightTypes = 1
-    };
+        return 0;
+    }
+};
 
-    static constexpr size_t x_numLightsPerType[] = {
-        x_gridSize * x_gridSize * static_cast<size_t>(LightColor::NumColors)
-    };
+// Everything the lattice display needs, published by the audio thread whenever it changes.
+//
+struct LatticeSnapshot
+{
+    // Bit i is set if voice i is on the cell.
+    //
+    uint8_t m_voices[LatticeExpanderConstants::x_gridSize][LatticeExpanderConstants::x_gridSize];
+    int m_intervalSemitones[LogicMatrixConstants::x_numAccumulators];
 
-    static constexpr size_t x_lightStartPerType[] = {
-        0,
-        x_numLightsPerType[0]
+    // Per voice, a ring buffer of the cells it has most recently left.  Brightness 0 means the
+    // entry is unused or has faded out.
+    //
+    struct TrailEntry
+    {
+        uint8_t m_x;
+        uint8_t m_y;
+        float m_brightness;
     };
 
-    static constexpr size_t GetLightId(LightType lightType, size_t lightId)
+    TrailEntry m_trails[LogicMatrixConstants::x_numAccumulators][LatticeExpanderConstants::x_trailLength];
+
+    LatticeSnapshot()
     {
-        return x_lightStartPerType[static_cast<int>(lightType)] + lightId;
+        memset(this, 0, sizeof(LatticeSnapshot));
     }
+};
 
-    static constexpr size_t GetLatticeLightId(size_t x, size_t y, LightColor color)
+// Which InputVectors put each voice on each lattice position, keyed by the m_high triple.
+// Built by the LogicMatrix on the left whenever its params change (and over and over while
+// pitch CV is patched), and handed over whole.
+//
+struct LatticeIndex
+{
+    // Each coordinate counts high operations, so runs from 0 to x_numOperations.
+    //
+    static constexpr size_t x_extent = LogicMatrixConstants::x_numOperations + 1;
+
+    uint64_t m_vectors[LogicMatrixConstants::x_numAccumulators][x_extent][x_extent][x_extent];
+
+    LatticeIndex()
     {
-        return static_cast<size_t>(LightColor::NumColors) * (x + x_gridSize * y)
-            + static_cast<size_t>(color);
+        Clear();
     }
 
-    static constexpr size_t GetNumLights()
+    void Clear()
     {
-        return x_lightStartPerType[static_cast<int>(LightType::NumLightTypes)];
+        memset(m_vectors, 0, sizeof(m_vectors));
+    }
+
+    void Add(size_t accumId, const uint8_t* position, uint8_t inputVector)
+    {
+        m_vectors[accumId][position[0]][position[1]][position[2]] |= uint64_t(1) << inputVector;
+    }
+
+    uint64_t GetVectors(size_t accumId, size_t x, size_t y, size_t z) const
+    {
+        if (x >= x_extent || y >= x_extent || z >= x_extent)
+        {
+            return 0;
+        }
+
+        return m_vectors[accumId][x][y][z];
     }
 };
 
@@ -80,7 +159,35 @@ struct LatticeExpander : Module
 {
 	LatticeExpanderMessage m_leftMessages[2][1];
     LatticeExpanderMessage m_prevMessage;
-    Lattice::NoteName m_noteNames[LatticeExpanderConstants::x_gridSize][LatticeExpanderConstants::x_gridSize];
+    rack::dsp::ClockDivider m_lightDivider;
+
+    // Where each voice's next trail entry goes, and whether any entry still needs fading.
+    //
+    size_t m_trailHeads[LogicMatrixConstants::x_numAccumulators] = {};
+    bool m_trailsLit = false;
+    rack::dsp::ClockDivider m_trailDivider;
+    Trace::Tracer m_tracer;
+
+    // Started and stopped by the LogicMatrix on the left, which writes the report.
+    //
+    Latency::Meter m_latency;
+
+    Snapshot<LatticeSnapshot> m_snapshot;
+
+    // Written by the LogicMatrix on the left, read by the widget on hover.
+    //
+    Snapshot<LatticeIndex> m_index;
+
+    // How many samples each InputVector has been seen for.  Only this module's process writes
+    // them, so relaxed loads and stores are enough.  64 bits, as 32 would wrap within a day at 48kHz.
+    //
+    std::atomic<uint64_t> m_visits[1 << LogicMatrixConstants::x_numInputs];
+
+    // Scale masks, edited from the widget and sent to the LogicMatrix every sample.
+    // m_maskVoice is which voice clicking a cell edits, and is only touched by the UI.
+    //
+    std::atomic<uint64_t> m_cellMasks[LogicMatrixConstants::x_numAccumulators];
+    size_t m_maskVoice = 0;
 
 	LatticeExpander()
     {
@@ -90,8 +197,77 @@ struct LatticeExpander : Module
         
 		leftExpander.producerMessage = m_leftMessages[0];	
 		leftExpander.consumerMessage = m_leftMessages[1];	
+
+        m_lightDivider.setDivision(LogicMatrixConstants::x_lightDivisions[LogicMatrixConstants::x_defaultLightDivisionIndex]);
+        m_trailDivider.setDivision(x_trailFadeDivision);
+
+        for (std::atomic<uint64_t>& visits : m_visits)
+        {
+            visits.store(0, std::memory_order_relaxed);
+        }
+
+        for (std::atomic<uint64_t>& cellMask : m_cellMasks)
+        {
+            cellMask.store(0, std::memory_order_relaxed);
+        }
 	}
 
+    // Called from the UI thread.
+    //
+    void ToggleCell(size_t x, size_t y)
+    {
+        m_cellMasks[m_maskVoice].fetch_xor(uint64_t(1) << LatticeExpanderConstants::GetCellBit(x, y));
+    }
+
+    void SendMaskMessage()
+    {
+        LatticeMaskMessage* msg = static_cast<LatticeMaskMessage*>(leftExpander.module->rightExpander.producerMessage);
+        for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
+        {
+            msg->m_cellMasks[i] = m_cellMasks[i].load(std::memory_order_relaxed);
+        }
+
+        leftExpander.module->rightExpander.messageFlipRequested = true;
+    }
+
+    json_t* dataToJson() override
+    {
+        json_t* rootJ = json_object();
+        json_t* cellMasksJ = json_array();
+        for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
+        {
+            char cellMask[17];
+            snprintf(cellMask, sizeof(cellMask), "%016llx", static_cast<unsigned long long>(m_cellMasks[i].load()));
+            json_array_append_new(cellMasksJ, json_string(cellMask));
+        }
+
+        json_object_set_new(rootJ, "cellMasks", cellMasksJ);
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override
+    {
+        json_t* cellMasksJ = json_object_get(rootJ, "cellMasks");
+        for (size_t i = 0; cellMasksJ && i < LogicMatrixConstants::x_numAccumulators && i < json_array_size(cellMasksJ); ++i)
+        {
+            json_t* cellMaskJ = json_array_get(cellMasksJ, i);
+            m_cellMasks[i].store(json_is_string(cellMaskJ) ? strtoull(json_string_value(cellMaskJ), nullptr, 16) : 0);
+        }
+    }
+
+    bool PositionChanged(LatticeExpanderMessage* msg, size_t accumId)
+    {
+        return msg->m_position[accumId][0] != m_prevMessage.m_position[accumId][0] ||
+            msg->m_position[accumId][1] != m_prevMessage.m_position[accumId][1] ||
+            msg->m_position[accumId][2] != m_prevMessage.m_position[accumId][2];
+    }
+
+    bool IntervalsChanged(LatticeExpanderMessage* msg)
+    {
+        return msg->m_intervalSemitones[0] != m_prevMessage.m_intervalSemitones[0] ||
+            msg->m_intervalSemitones[1] != m_prevMessage.m_intervalSemitones[1];
+    }
+
     void ProcessLights()
     {        
         using namespace LatticeExpanderConstants;
@@ -99,51 +275,89 @@ struct LatticeExpander : Module
         
         for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
         {
-            if (msg->m_position[i][0] != m_prevMessage.m_position[i][0] ||
-                msg->m_position[i][1] != m_prevMessage.m_position[i][1] ||
-                msg->m_position[i][2] != m_prevMessage.m_position[i][2])
+            if (PositionChanged(msg, i))
             {
-                SetLightFromArray(m_prevMessage.m_position[i], i, false);
-                SetLightFromArray(msg->m_position[i], i, true);
+                SetCellFromArray(m_prevMessage.m_position[i], i, false);
+                SetCellFromArray(msg->m_position[i], i, true);
+                PushTrail(m_prevMessage.m_position[i], i);
             }
         }
     }
 
-    void ProcessTextFields()
+    // Called between BeginWrite and EndWrite, like the rest of ProcessLights.
+    //
+    void PushTrail(int* values, size_t accumId)
+    {
+        if (!IsOnGrid(values))
+        {
+            return;
+        }
+
+        LatticeSnapshot::TrailEntry& entry = m_snapshot.m_value.m_trails[accumId][m_trailHeads[accumId]];
+        entry.m_x = static_cast<uint8_t>(values[0]);
+        entry.m_y = static_cast<uint8_t>(values[1]);
+        entry.m_brightness = 1.f;
+        m_trailHeads[accumId] = (m_trailHeads[accumId] + 1) % LatticeExpanderConstants::x_trailLength;
+        m_trailsLit = true;
+    }
+
+    // Only the trail entries are touched, so this costs the same whatever the grid size, and
+    // nothing at all once every trail has faded out.
+    //
+    void FadeTrails(float dt)
     {
         using namespace LatticeExpanderConstants;
-        LatticeExpanderMessage* msg = static_cast<LatticeExpanderMessage*>(leftExpander.consumerMessage);
 
-        if (msg->m_intervalSemitones[0] != m_prevMessage.m_intervalSemitones[0] ||
-            msg->m_intervalSemitones[1] != m_prevMessage.m_intervalSemitones[1])
+        float step = dt / x_trailFadeSeconds;
+        bool lit = false;
+
+        m_snapshot.BeginWrite();
+        for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
         {
-            int intervals[] = {msg->m_intervalSemitones[0], msg->m_intervalSemitones[1], msg->m_intervalSemitones[2]};
+            for (LatticeSnapshot::TrailEntry& entry : m_snapshot.m_value.m_trails[i])
+            {
+                entry.m_brightness = std::max(entry.m_brightness - step, 0.f);
+                lit |= entry.m_brightness > 0;
+            }
+        }
 
-            for (size_t i = 0; i < x_gridSize; ++i)
+        m_snapshot.EndWrite();
+        m_trailsLit = lit;
+    }
+
+    // Note names are worked out by the widget on the UI thread; all that happens here is
+    // handing over the intervals.
+    //
+    void ProcessTextFields()
+    {
+        LatticeExpanderMessage* msg = static_cast<LatticeExpanderMessage*>(leftExpander.consumerMessage);
+
+        if (IntervalsChanged(msg))
+        {
+            for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
             {
-                for (size_t j = 0; j < x_gridSize; ++j)
-                {
-                    int pos[] = {static_cast<int>(i), static_cast<int>(j), 0};
-                    Lattice::Note note(pos, intervals);
-                    m_noteNames[i][j] = note.ToNoteName();
-                }
+                m_snapshot.m_value.m_intervalSemitones[i] = msg->m_intervalSemitones[i];
             }
         }
     }
 
-    void SetLightFromArray(int* values, size_t accumId, bool value)
+    static bool IsOnGrid(const int* values)
     {
         using namespace LatticeExpanderConstants;
 
-        LightColor color = static_cast<LightColor>(accumId);
-        
+        return static_cast<size_t>(values[0]) < x_gridSize &&
+            static_cast<size_t>(values[1]) < x_gridSize &&
+            static_cast<size_t>(values[2]) == 0;
+    }
+
+    void SetCellFromArray(int* values, size_t accumId, bool value)
+    {
         // Do nothing if the position is off the grid.
         //
-        if (static_cast<size_t>(values[0]) < x_gridSize &&
-            static_cast<size_t>(values[1]) < x_gridSize &&
-            static_cast<size_t>(values[2]) == 0)
+        if (IsOnGrid(values))
         {
-            lights[GetLatticeLightId(values[0], values[1], color)].setBrightness(value ? 1.f : 0.f);
+            uint8_t& cell = m_snapshot.m_value.m_voices[values[0]][values[1]];
+            cell = value ? (cell | (1 << accumId)) : (cell & ~(1 << accumId));
         }        
     }
 
@@ -152,9 +366,47 @@ struct LatticeExpander : Module
 		if (leftExpander.module &&
 			leftExpander.module->model == modelLogicMatrix)
         {
-            ProcessLights();
-            ProcessTextFields();
-            m_prevMessage = *static_cast<LatticeExpanderMessage*>(leftExpander.consumerMessage);
+            // Only look at the message every few samples, following the light division
+            // chosen on the LogicMatrix.  Positions held for less than that are not shown.
+            //
+            LatticeExpanderMessage* msg = static_cast<LatticeExpanderMessage*>(leftExpander.consumerMessage);
+            bool measuring = m_latency.Begin();
+            if (measuring && msg->m_edgeFrame > m_latency.m_lastEdge)
+            {
+                m_latency.OnEdge(msg->m_edgeFrame);
+                m_latency.OnChange(Latency::Path::LatticeMessage, args.frame);
+            }
+
+            std::atomic<uint64_t>& visits = m_visits[msg->m_inputVector % (1 << LogicMatrixConstants::x_numInputs)];
+            visits.store(visits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            SendMaskMessage();
+
+            if (msg->m_lightDivision != 0 && msg->m_lightDivision != m_lightDivider.getDivision())
+            {
+                m_lightDivider.setDivision(msg->m_lightDivision);
+            }
+
+            if (m_lightDivider.process() &&
+                (PositionChanged(msg, 0) || PositionChanged(msg, 1) || PositionChanged(msg, 2) || IntervalsChanged(msg)))
+            {
+                m_snapshot.BeginWrite();
+                ProcessLights();
+                m_tracer.Begin(Trace::Stage::ProcessTextFields, msg->m_inputVector);
+                ProcessTextFields();
+                m_tracer.End(Trace::Stage::ProcessTextFields, msg->m_inputVector);
+                m_prevMessage = *msg;
+                m_snapshot.EndWrite();
+
+                if (measuring)
+                {
+                    m_latency.OnChange(Latency::Path::LatticeLights, args.frame);
+                }
+            }
+
+            if (m_trailDivider.process() && m_trailsLit)
+            {
+                FadeTrails(args.sampleTime * m_trailDivider.getDivision());
+            }
         }
 	}
 };
@@ -2,30 +2,6 @@
 
 struct LatticeExpanderWidget : ModuleWidget
 {
-    struct CustomTextFieldWidget : LedDisplayTextField
-    {
-        LatticeExpander* m_module;
-        int m_xPos;
-        int m_yPos;
-        
-        void Init(LatticeExpander* module, int xPos, int yPos)
-        {
-            m_module = module;
-            m_xPos = xPos;
-            m_yPos = yPos;
-        }
-        
-        void step() override
-        {
-            if (m_module)
-            {
-                setText(m_module->m_noteNames[m_xPos][m_yPos].GetNoteString());
-            }
-            
-            LedDisplayTextField::step();
-        }
-    };
-    
     static constexpr float x_hp = 5.08;
 
     static constexpr float x_lightSpacingHP = 2.0;
@@ -34,9 +10,16 @@ struct LatticeExpanderWidget : ModuleWidget
     static constexpr float x_lightStartYHP = 10.0;
     static constexpr float x_lightSpaceHP = 0.5;
 
-    CustomTextFieldWidget* m_noteValues[LatticeExpanderConstants::x_gridSize][LatticeExpanderConstants::x_gridSize];	
+    static constexpr float x_lightRadiusMM = 1.588;
+    static constexpr float x_noteFontSize = 12.0;
+
+    static constexpr float x_hoverBoxXHP = 1.0;
+    static constexpr float x_hoverBoxYHP = 21.5;
+    static constexpr float x_hoverLineHP = 0.8;
+    static constexpr float x_hoverFontSize = 10.0;
+    static constexpr size_t x_maxHoverVectors = 4;
 
-    Vec GetLightMM(size_t x, size_t y, LatticeExpanderConstants::LightColor color)
+    static Vec GetLightMM(size_t x, size_t y, LatticeExpanderConstants::LightColor color)
     {
         using namespace LatticeExpanderConstants;
 
@@ -48,47 +31,357 @@ struct LatticeExpanderWidget : ModuleWidget
                    x_hp * (x_lightStartYHP + y * x_lightSpacingHP + yOffset));
     }
 
-    LatticeExpanderWidget(LatticeExpander* module)
+    static Vec GetNoteBoxSizeMM()
     {
-        using namespace LatticeExpanderConstants;   
+        return Vec(8 * x_hp * x_lightSpaceHP, 4 * x_hp * x_lightSpaceHP);
+    }
 
-		setModule(module);
-		setPanel(createPanel(asset::plugin(pluginInstance, "res/LatticeExpander.svg")));
+    // The inverse of GetLightMM, for the cell under the mouse.
+    //
+    static bool GetCellAtMM(Vec mm, size_t* x, size_t* y)
+    {
+        using namespace LatticeExpanderConstants;
 
-		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
-		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
-		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
-        
-        for (size_t x = 0; x < x_gridSize; ++x)
+        float cellX = (mm.x / x_hp - x_lightStartXHP + x_lightSpaceHP) / x_lightSpacingHP;
+        float cellY = (mm.y / x_hp - x_lightStartYHP + x_lightSpaceHP) / x_lightSpacingHP;
+        if (cellX < 0 || cellY < 0 || cellX >= x_gridSize || cellY >= x_gridSize)
         {
-            for (size_t y = 0; y < x_gridSize; ++y)
+            return false;
+        }
+
+        *x = static_cast<size_t>(cellX);
+        *y = x_gridSize - static_cast<size_t>(cellY) - 1;
+        return true;
+    }
+
+    // Draws the whole lattice (voice markers and note labels) in one pass, into a framebuffer
+    // that is only redrawn when the module publishes a new snapshot.
+    //
+    struct LatticeDisplay : FramebufferWidget
+    {
+        struct Drawer : TransparentWidget
+        {
+            LatticeDisplay* m_display = nullptr;
+
+            void draw(const DrawArgs& args) override
             {
-                addChild(createLightCentered<MediumLight<RedLight>>(
-                             mm2px(GetLightMM(x, y, LightColor::Red)),
-                             module,
-                             GetLatticeLightId(x, y, LightColor::Red)));
-                addChild(createLightCentered<MediumLight<GreenLight>>(
-                             mm2px(GetLightMM(x, y, LightColor::Green)),
-                             module,
-                             GetLatticeLightId(x, y, LightColor::Green)));
-                addChild(createLightCentered<MediumLight<BlueLight>>(
-                             mm2px(GetLightMM(x, y, LightColor::Blue)),
-                             module,
-                             GetLatticeLightId(x, y, LightColor::Blue)));
+                m_display->DrawLattice(args.vg);
             }
+        };
+
+        LatticeExpander* m_module = nullptr;
+        LatticeSnapshot m_snapshot;
+        uint32_t m_generation = 0;
+        LatticeIndex m_index;
+        uint32_t m_indexGeneration = 0;
+        bool m_hovering = false;
+        size_t m_hoverX = 0;
+        size_t m_hoverY = 0;
+        uint64_t m_cellMask = 0;
+        size_t m_maskVoice = 0;
+        Lattice::NoteName m_noteNames[LatticeExpanderConstants::x_gridSize][LatticeExpanderConstants::x_gridSize];
+
+        void Init(LatticeExpander* module, Vec size)
+        {
+            m_module = module;
+            box.size = size;
+
+            Drawer* drawer = new Drawer();
+            drawer->m_display = this;
+            drawer->box.size = size;
+            addChild(drawer);
+
+            ComputeNoteNames();
         }
 
-        for (size_t x = 0; x < x_gridSize; ++x)
+        void ComputeNoteNames()
         {
-            for (size_t y = 0; y < x_gridSize; ++y)
+            using namespace LatticeExpanderConstants;
+
+            int intervals[] = {
+                m_snapshot.m_intervalSemitones[0],
+                m_snapshot.m_intervalSemitones[1],
+                m_snapshot.m_intervalSemitones[2]
+            };
+
+            for (size_t i = 0; i < x_gridSize; ++i)
             {
-                m_noteValues[x][y] = createWidget<CustomTextFieldWidget>(mm2px(GetLightMM(x, y, LightColor::Red)));
-                m_noteValues[x][y]->box.size = mm2px(Vec(8 * x_hp * x_lightSpaceHP, 4 * x_hp * x_lightSpaceHP));
-                m_noteValues[x][y]->Init(module, x, y);
-                addChild(m_noteValues[x][y]);
+                for (size_t j = 0; j < x_gridSize; ++j)
+                {
+                    int pos[] = {static_cast<int>(i), static_cast<int>(j), 0};
+                    Lattice::Note note(pos, intervals);
+                    m_noteNames[i][j] = note.ToNoteName();
+                }
             }
         }
+
+        void step() override
+        {
+            if (m_module)
+            {
+                LatticeSnapshot prev = m_snapshot;
+                if (m_module->m_snapshot.Read(&m_snapshot, &m_generation))
+                {
+                    if (memcmp(prev.m_intervalSemitones, m_snapshot.m_intervalSemitones, sizeof(prev.m_intervalSemitones)) != 0)
+                    {
+                        ComputeNoteNames();
+                    }
+
+                    setDirty();
+                }
+
+                // The visit counts move every sample, so keep redrawing while a cell is hovered.
+                //
+                m_module->m_index.Read(&m_index, &m_indexGeneration);
+                if (m_hovering)
+                {
+                    setDirty();
+                }
+
+                uint64_t cellMask = m_module->m_cellMasks[m_module->m_maskVoice].load(std::memory_order_relaxed);
+                if (cellMask != m_cellMask || m_module->m_maskVoice != m_maskVoice)
+                {
+                    m_cellMask = cellMask;
+                    m_maskVoice = m_module->m_maskVoice;
+                    setDirty();
+                }
+            }
+
+            FramebufferWidget::step();
+        }
+
+        void onHover(const HoverEvent& e) override
+        {
+            size_t x = 0;
+            size_t y = 0;
+            bool hovering = GetCellAtMM(Vec(e.pos.x / mm2px(1.f), e.pos.y / mm2px(1.f)), &x, &y);
+            if (hovering != m_hovering || x != m_hoverX || y != m_hoverY)
+            {
+                m_hovering = hovering;
+                m_hoverX = x;
+                m_hoverY = y;
+                setDirty();
+            }
+
+            FramebufferWidget::onHover(e);
+            if (m_hovering)
+            {
+                e.consume(this);
+            }
+        }
+
+        // Clicking a cell adds it to, or removes it from, the scale mask of the voice picked in
+        // the context menu.
+        //
+        void onButton(const ButtonEvent& e) override
+        {
+            size_t x = 0;
+            size_t y = 0;
+            if (m_module &&
+                e.action == GLFW_PRESS &&
+                e.button == GLFW_MOUSE_BUTTON_LEFT &&
+                GetCellAtMM(Vec(e.pos.x / mm2px(1.f), e.pos.y / mm2px(1.f)), &x, &y))
+            {
+                m_module->ToggleCell(x, y);
+                e.consume(this);
+                return;
+            }
+
+            FramebufferWidget::onButton(e);
+        }
+
+        void onLeave(const LeaveEvent& e) override
+        {
+            m_hovering = false;
+            setDirty();
+            FramebufferWidget::onLeave(e);
+        }
+
+        void DrawLattice(NVGcontext* vg)
+        {
+            using namespace LatticeExpanderConstants;
+
+            static const NVGcolor x_onColors[] = {
+                nvgRGB(0xed, 0x2c, 0x24),
+                nvgRGB(0x90, 0xc7, 0x3e),
+                nvgRGB(0x29, 0xb2, 0xef)
+            };
+
+            static const NVGcolor x_offColor = nvgRGB(0x33, 0x33, 0x33);
+            static constexpr float x_trailAlpha = 0.6;
+            static const NVGcolor x_noteBgColor = nvgRGB(0x00, 0x00, 0x00);
+            static const NVGcolor x_noteColor = nvgRGB(0xff, 0xd7, 0x14);
+
+            std::shared_ptr<window::Font> font = APP->window->loadFont(asset::system("res/fonts/ShareTechMono-Regular.ttf"));
+            Vec noteBoxSize = mm2px(GetNoteBoxSizeMM());
+
+            // A cell visited twice in the trail shows the more recent visit.
+            //
+            float trails[LogicMatrixConstants::x_numAccumulators][x_gridSize][x_gridSize] = {};
+            for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
+            {
+                for (const LatticeSnapshot::TrailEntry& entry : m_snapshot.m_trails[i])
+                {
+                    float& trail = trails[i][entry.m_x][entry.m_y];
+                    trail = std::max(trail, entry.m_brightness);
+                }
+            }
+
+            for (size_t x = 0; x < x_gridSize; ++x)
+            {
+                for (size_t y = 0; y < x_gridSize; ++y)
+                {
+                    uint8_t voices = m_snapshot.m_voices[x][y];
+                    for (size_t color = 0; color < static_cast<size_t>(LightColor::NumColors); ++color)
+                    {
+                        Vec center = mm2px(GetLightMM(x, y, static_cast<LightColor>(color)));
+                        nvgBeginPath(vg);
+                        nvgCircle(vg, center.x, center.y, mm2px(x_lightRadiusMM));
+                        nvgFillColor(vg, (voices & (1 << color)) ? x_onColors[color] : nvgLerpRGBA(x_offColor, x_onColors[color], x_trailAlpha * trails[color][x][y]));
+                        nvgFill(vg);
+                    }
+
+                    Vec notePos = mm2px(GetLightMM(x, y, LightColor::Red));
+                    nvgBeginPath(vg);
+                    nvgRoundedRect(vg, notePos.x, notePos.y, noteBoxSize.x, noteBoxSize.y, 2.0);
+                    nvgFillColor(vg, x_noteBgColor);
+                    nvgFill(vg);
+
+                    if ((m_cellMask >> GetCellBit(x, y)) & 1)
+                    {
+                        nvgStrokeColor(vg, x_onColors[m_maskVoice]);
+                        nvgStrokeWidth(vg, 1.0);
+                        nvgStroke(vg);
+                    }
+
+                    if (font && font->handle >= 0)
+                    {
+                        nvgFontFaceId(vg, font->handle);
+                        nvgFontSize(vg, x_noteFontSize);
+                        nvgTextAlign(vg, NVG_ALIGN_LEFT | NVG_ALIGN_MIDDLE);
+                        nvgFillColor(vg, x_noteColor);
+                        nvgText(vg, notePos.x + 3.0, notePos.y + noteBoxSize.y / 2, m_noteNames[x][y].GetNoteString(), nullptr);
+                    }
+                }
+            }
+
+            if (m_hovering && m_module && font && font->handle >= 0)
+            {
+                DrawHover(vg, font, x_onColors);
+            }
+        }
+
+        // One line per voice: which InputVectors put it on the hovered cell, and how much of
+        // the time the module has spent on them.
+        //
+        void DrawHover(NVGcontext* vg, std::shared_ptr<window::Font> font, const NVGcolor* colors)
+        {
+            using namespace LogicMatrixConstants;
+
+            uint64_t visits[1 << x_numInputs];
+            uint64_t totalVisits = 0;
+            for (size_t i = 0; i < (1 << x_numInputs); ++i)
+            {
+                visits[i] = m_module->m_visits[i].load(std::memory_order_relaxed);
+                totalVisits += visits[i];
+            }
+
+            Vec pos = mm2px(Vec(x_hp * x_hoverBoxXHP, x_hp * x_hoverBoxYHP));
+            float lineHeight = mm2px(x_hp * x_hoverLineHP);
+            nvgFontFaceId(vg, font->handle);
+            nvgFontSize(vg, x_hoverFontSize);
+            nvgTextAlign(vg, NVG_ALIGN_LEFT | NVG_ALIGN_TOP);
+
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                uint64_t vectors = m_index.GetVectors(i, m_hoverX, m_hoverY, 0);
+                size_t numVectors = 0;
+                uint64_t cellVisits = 0;
+                std::string line;
+                for (size_t v = 0; v < (1 << x_numInputs); ++v)
+                {
+                    if (!((vectors >> v) & 1))
+                    {
+                        continue;
+                    }
+
+                    cellVisits += visits[v];
+                    if (numVectors < x_maxHoverVectors)
+                    {
+                        for (size_t bit = 0; bit < x_numInputs; ++bit)
+                        {
+                            line += ((v >> bit) & 1) ? '1' : '0';
+                        }
+
+                        line += ' ';
+                    }
+
+                    ++numVectors;
+                }
+
+                if (numVectors > x_maxHoverVectors)
+                {
+                    line += "+" + std::to_string(numVectors - x_maxHoverVectors) + " ";
+                }
+
+                int percent = totalVisits ? static_cast<int>(100 * cellVisits / totalVisits) : 0;
+                line = std::to_string(numVectors) + "/64 " + std::to_string(percent) + "%  " + line;
+
+                nvgFillColor(vg, colors[i]);
+                nvgText(vg, pos.x, pos.y + i * lineHeight, line.c_str(), nullptr);
+            }
+        }
+    };
+
+    LatticeExpanderWidget(LatticeExpander* module)
+    {
+		setModule(module);
+		setPanel(createPanel(asset::plugin(pluginInstance, "res/LatticeExpander.svg")));
+
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+        LatticeDisplay* display = createWidget<LatticeDisplay>(Vec(0, 0));
+        display->Init(module, box.size);
+        addChild(display);
+    }
+
+    void appendContextMenu(Menu* menu) override
+    {
+        LatticeExpander* module = dynamic_cast<LatticeExpander*>(this->module);
+        if (!module)
+        {
+            return;
+        }
+
+        std::string tracePath = asset::user("LatticeExpander-" + std::to_string(module->id) + ".trace.json");
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem(
+                           "Clicking a cell edits the scale of",
+                           {"Voice 1 (red)", "Voice 2 (green)", "Voice 3 (blue)"},
+                           [=]() { return module->m_maskVoice; },
+                           [=](size_t voice) { module->m_maskVoice = voice; }));
+        menu->addChild(createMenuItem(
+                           "Clear scale",
+                           "",
+                           [=]() { module->m_cellMasks[module->m_maskVoice].store(0); }));
+        menu->addChild(createBoolMenuItem(
+                           "Trace timeline to file",
+                           "",
+                           [=]() { return module->m_tracer.IsEnabled(); },
+                           [=](bool enable)
+                           {
+                               if (enable)
+                               {
+                                   module->m_tracer.Start(tracePath, module->id);
+                               }
+                               else
+                               {
+                                   module->m_tracer.Stop();
+                               }
+                           }));
     }
 };
 
@@ -6,218 +6,720 @@ Enum FloatToEnum(float in)
     return static_cast<Enum>(static_cast<int>(in + 0.5));
 }
 
-void LogicMatrix::Input::SetValue(LogicMatrix::Input* prev)
+LogicMatrix::InputVector
+LogicMatrix::InputStage::Process(int64_t frame)
 {
     using namespace LogicMatrixConstants;
-    bool oldValue = m_value;
-        
-    // If a cable is connected, use that value.
+    using rack::simd::float_4;
+
+    // Unpatched lanes are fed a voltage between the thresholds, so their trigger holds its state
+    // until a cable is connected again.
     //
-    if (m_port->isConnected())
+    float voltages[x_numLanes] = {};
+    uint32_t connected = 0;
+    for (size_t i = 0; i < x_numInputs; ++i)
     {
-        float cableValue = m_port->getVoltage();
-        m_schmittTrigger.process(cableValue);
-        m_value = m_schmittTrigger.isHigh();
-        if (m_value && !oldValue)
-        {
-            ++m_counter;
-        }
+        bool isConnected = m_ports[i]->isConnected();
+        voltages[i] = isConnected ? m_ports[i]->getVoltage() : 0.5f;
+        connected |= static_cast<uint32_t>(isConnected) << i;
     }
-    
-    // Each input (except the first) is normaled to divide-by-two of the previous input.
+
+    m_schmittTriggers[0].process(float_4::load(voltages));
+    m_schmittTriggers[1].process(float_4::load(voltages + 4));
+    uint32_t high = rack::simd::movemask(m_schmittTriggers[0].isHigh()) |
+        (rack::simd::movemask(m_schmittTriggers[1].isHigh()) << 4);
+    if ((high ^ m_triggerStates) & connected)
+    {
+        m_lastCrossing = frame;
+    }
+
+    m_triggerStates = high;
+
+    // If a cable is connected, use that value.  An unpatched first input holds its last value.
     //
-    else if (prev)
+    uint32_t prev = m_values.m_bits;
+    uint32_t bits = (high & connected) | (prev & ~connected & 1);
+    uint32_t rising = bits & ~prev & connected;
+    for (size_t i = 0; i < x_numInputs; ++i)
     {
-        m_value = prev->m_counter % 2;
-        m_counter = prev->m_counter / 2;        
+        m_counters[i] += (rising >> i) & 1;
     }
 
-    if (oldValue != m_value)
+    // Each input (except the first) is normaled to divide-by-two of the previous input.
+    // normalMask is all ones for an unpatched input and zero otherwise, so there is no branching.
+    //
+    for (size_t i = 1; i < x_numInputs; ++i)
     {
-        m_light->setBrightness(m_value ? 1.f : 0.f);
+        uint32_t normalled = (~connected >> i) & 1;
+        uint8_t normalMask = static_cast<uint8_t>(-normalled);
+        bits |= (m_counters[i - 1] & normalled) << i;
+        m_counters[i] = (m_counters[i] & ~normalMask) | ((m_counters[i - 1] >> 1) & normalMask);
     }
-}
 
-LogicMatrix::MatrixElement::SwitchVal
-LogicMatrix::MatrixElement::GetSwitchVal()
-{
-    return FloatToEnum<SwitchVal>(m_switch->getValue());
+    m_values = InputVector(bits);
+    m_connected = InputVector(connected);
+    m_lightLatch.m_bits |= bits;
+    return m_values;
 }
 
-size_t LogicMatrix::InputVector::CountSetBits()
+bool LogicMatrix::LogicOperation::OperatorDefinition::GetValue(
+    Operator knobOperator,
+    uint8_t maskedVector,
+    size_t countHigh,
+    size_t countTotal) const
 {
-    static const uint8_t x_bitsSet [16] =
+    bool ret = false;
+    switch (m_type)
     {
-        0, 1, 1, 2, 1, 2, 2, 3, 
-        1, 2, 2, 3, 2, 3, 3, 4
-    };
+        case Type::Knob: ret = LogicMatrixConstants::GetKnobOperatorValue(static_cast<size_t>(knobOperator), countHigh, countTotal); break;
+        case Type::AtLeast: ret = (countHigh >= m_k); break;
+        case Type::Exactly: ret = (countHigh == m_k); break;
+        case Type::Nand: ret = (countHigh != countTotal); break;
+        case Type::Nor: ret = (countHigh == 0); break;
+        case Type::TruthTable: ret = (m_truthTable >> maskedVector) & 1; break;
+        case Type::NumTypes: break;
+    }
 
-    return x_bitsSet[m_bits & 0x0F] + x_bitsSet[m_bits >> 4];
+    return ret;
 }
 
-LogicMatrix::LogicOperation::Operator
-LogicMatrix::LogicOperation::GetOperator()
+std::string LogicMatrix::LogicOperation::OperatorDefinition::GetName() const
 {
-    return FloatToEnum<Operator>(m_operatorKnob->getValue());
+    switch (m_type)
+    {
+        case Type::Knob: return "Knob";
+        case Type::AtLeast: return "At least " + std::to_string(m_k);
+        case Type::Exactly: return "Exactly " + std::to_string(m_k);
+        case Type::Nand: return "NAND";
+        case Type::Nor: return "NOR";
+        case Type::TruthTable: return "Truth table";
+        case Type::NumTypes: break;
+    }
+
+    return "";
 }
 
-LogicMatrix::LogicOperation::SwitchVal
-LogicMatrix::LogicOperation::GetSwitchVal()
+// Table c is the operator with c of the operation inputs high on top of the gate inputs.
+//
+void LogicMatrix::LogicOperation::Compile(
+    const OperatorDefinition& definition,
+    Operator knobOperator,
+    size_t countTotal,
+    size_t numOperationInputs)
 {
-    return FloatToEnum<SwitchVal>(m_switch->getValue());
+    using namespace LogicMatrixConstants;
+
+    for (size_t c = 0; c <= numOperationInputs; ++c)
+    {
+        uint64_t truthTable = 0;
+        for (size_t i = 0; i < (1 << x_numInputs); ++i)
+        {
+            uint8_t maskedVector = static_cast<uint8_t>(i);
+            size_t countHigh = InputVector(maskedVector).CountSetBits() + c;
+            if (definition.GetValue(knobOperator, maskedVector, countHigh, countTotal + numOperationInputs))
+            {
+                truthTable |= uint64_t(1) << i;
+            }
+        }
+
+        m_truthTables[c] = truthTable;
+    }
 }
 
-bool LogicMatrix::LogicOperation::GetValue(InputVector inputVector)
+// Turns a truth table indexed by masked vector into one indexed by InputVector, an input at a
+// time and without branches.  An inverted input swaps the halves of the table that differ in its
+// bit.  A muted input always reads low, so the half where its bit is clear is copied over the other.
+//
+static uint64_t ExpandTruthTable(uint64_t truthTable, uint8_t active, uint8_t inverted)
 {
-    using namespace LogicMatrixConstants;   
+    using namespace LogicMatrixConstants;
 
-    // And with m_active to mute the muted inputs.
-    // Xor with m_inverted to invert the inverted ones.
+    // Bit v of x_inputMasks[j] is bit j of v.
     //
-    inputVector.m_bits &= m_active.m_bits;
-    inputVector.m_bits ^= m_inverted.m_bits;
-    
-    size_t countTotal = m_active.CountSetBits();
-    size_t countHigh = inputVector.CountSetBits();
+    static constexpr uint64_t x_inputMasks[] = {
+        0xAAAAAAAAAAAAAAAAull,
+        0xCCCCCCCCCCCCCCCCull,
+        0xF0F0F0F0F0F0F0F0ull,
+        0xFF00FF00FF00FF00ull,
+        0xFFFF0000FFFF0000ull,
+        0xFFFFFFFF00000000ull
+    };
 
-    bool ret = false;
-    switch (GetOperator())
+    for (size_t j = 0; j < x_numInputs; ++j)
     {
-        case Operator::Or: ret = (countHigh > 0); break;
-        case Operator::And: ret = (countHigh == countTotal); break;
-        case Operator::Xor: ret = (countHigh % 2 == 1); break;
-        case Operator::AtLeastTwo: ret = (countHigh >= 2); break;
-        case Operator::Majority: ret = (2 * countHigh > countTotal); break;
+        size_t shift = size_t(1) << j;
+        uint64_t high = truthTable & x_inputMasks[j];
+        uint64_t low = truthTable & ~x_inputMasks[j];
+        uint64_t swapped = (high >> shift) | (low << shift);
+        uint64_t muted = low | (low << shift);
+
+        uint64_t activeMask = -static_cast<uint64_t>((active >> j) & 1);
+        uint64_t invertedMask = -static_cast<uint64_t>((inverted >> j) & 1);
+        truthTable = (activeMask & ((invertedMask & swapped) | (~invertedMask & truthTable))) | (~activeMask & muted);
     }
 
-    return ret;
+    return truthTable;
 }
 
-LogicMatrix::MatrixEvalResult LogicMatrix::EvalMatrix(InputVector inputVector)
+// Evaluates the matrix for a whole candidate set at once, one operation at a time, using the
+// truth tables in the hot state.
+//
+void LogicMatrix::EvalMatrix(const uint8_t* inputVectors, size_t numInputVectors, MatrixEvalResult* results)
 {
     using namespace LogicMatrixConstants;
-    MatrixEvalResult result;
 
     for (size_t i = 0; i < x_numOperations; ++i)
     {
-        size_t outputId = m_operations[i].GetOutputTarget();
-        ++result.m_total[outputId];
-        bool isHigh = m_operations[i].GetValue(inputVector);
-        if (isHigh)
+        size_t outputId = m_hot.m_outputTargets[i];
+        for (size_t j = 0; j < numInputVectors; ++j)
         {
-            ++result.m_high[outputId];
+            ++results[j].m_total[outputId];
+            results[j].m_high[outputId] += m_hot.GetValue(i, inputVectors[j]);
         }
     }
 
-    result.SetPitch(m_accumulators);
-
-    return result;
+    for (size_t j = 0; j < numInputVectors; ++j)
+    {
+        results[j].SetPitch(m_hot.m_intervalPitches);
+    }
 }
 
-LogicMatrix::InputVectorIterator::InputVectorIterator(InputVector coMuteVector, InputVector defaultVector)
-    : m_coMuteVector(coMuteVector)
-    , m_coMuteSize(m_coMuteVector.CountSetBits())
-    , m_defaultVector(defaultVector)
+constexpr int8_t LogicMatrix::Accumulator::x_primeExponents[][LogicMatrix::Accumulator::x_numPrimes];
+constexpr int LogicMatrix::Accumulator::x_semitones[];
+
+// Rebuilds everything in the hot state that comes from the latched params and module state.
+// Only called when the params generation moves, so the switches are read one by one here
+// rather than on every evaluation.
+//
+void LogicMatrix::UpdateHotState()
 {
-    size_t j = 0;
-    for (size_t i = 0; i < m_coMuteSize; ++i)
+    using namespace LogicMatrixConstants;
+    typedef MatrixElement::SwitchVal ElementSwitchVal;
+
+    uint8_t active[x_numOperations];
+    uint8_t inverted[x_numOperations];
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        InputVector activeVector;
+        InputVector invertedVector;
+        for (size_t j = 0; j < x_numInputs; ++j)
+        {
+            ElementSwitchVal switchVal = FloatToEnum<ElementSwitchVal>(m_paramsWatcher.m_params[GetMatrixSwitchId(j, i)]);
+            activeVector.Set(j, switchVal != ElementSwitchVal::Muted);
+            invertedVector.Set(j, switchVal == ElementSwitchVal::Inverted);
+        }
+
+        active[i] = activeVector.m_bits;
+        inverted[i] = invertedVector.m_bits;
+
+        // Up is output zero but input id 2, so invert.
+        //
+        LogicOperation::SwitchVal target = FloatToEnum<LogicOperation::SwitchVal>(m_paramsWatcher.m_params[GetOperationSwitchId(i)]);
+        m_hot.m_outputTargets[i] = x_numAccumulators - static_cast<size_t>(target) - 1;
+    }
+
+    CompileNetwork(active, inverted);
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        InputVector coMuteVector;
+        for (size_t j = 0; j < x_numInputs; ++j)
+        {
+            coMuteVector.Set(j, m_paramsWatcher.m_params[GetPitchCoMuteSwitchId(j, i)] < 0.5);
+        }
+
+        m_hot.m_coMuteVectors[i] = coMuteVector.m_bits;
+        m_hot.m_intervals[i] = static_cast<uint8_t>(FloatToEnum<Accumulator::Interval>(m_paramsWatcher.m_params[GetAccumulatorIntervalKnobId(i)]));
+    }
+
+    // Where each InputVector lands on the lattice doesn't depend on the voice, so evaluate all
+    // 64 once and turn each voice's cell mask into a mask over InputVectors.
+    //
+    uint8_t allVectors[1 << x_numInputs];
+    for (size_t i = 0; i < (1 << x_numInputs); ++i)
+    {
+        allVectors[i] = static_cast<uint8_t>(i);
+    }
+
+    MatrixEvalResult positions[1 << x_numInputs];
+    EvalMatrix(allVectors, 1 << x_numInputs, positions);
+
+    VoicePositions& voicePositions = m_voicePositions[1 - m_voicePositionsIndex];
+    for (size_t i = 0; i < (1 << x_numInputs); ++i)
+    {
+        memcpy(voicePositions.m_high[i], positions[i].m_high, x_numAccumulators);
+    }
+
+    m_voicePositionsIndex = 1 - m_voicePositionsIndex;
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
     {
-        while (!m_coMuteVector.Get(j))
+        uint64_t cellMask = m_paramsWatcher.m_state.m_cellMasks[i];
+        uint64_t allowed = cellMask ? 0 : ~uint64_t(0);
+        for (size_t j = 0; cellMask && j < (1 << x_numInputs); ++j)
         {
-            ++j;
+            const uint8_t* position = positions[j].m_high;
+            bool onGrid = position[0] < LatticeExpanderConstants::x_gridSize &&
+                position[1] < LatticeExpanderConstants::x_gridSize &&
+                position[2] == 0;
+            if (onGrid && ((cellMask >> LatticeExpanderConstants::GetCellBit(position[0], position[1])) & 1))
+            {
+                allowed |= uint64_t(1) << j;
+            }
         }
 
-        m_forwardingIndices[i] = j;
-        ++j;
+        m_hot.m_allowedVectors[i] = allowed;
     }
+
+    m_hot.m_paramsGeneration = m_paramsWatcher.m_generation;
 }
 
-LogicMatrix::InputVector
-LogicMatrix::InputVectorIterator::Get()
+// Compiles every operation to its output word over all 64 InputVectors, operation inputs first.
+// With c of its operation inputs high, an operation follows its truth table c, so its word is
+// the OR over c of where exactly c are high and table c (expanded) is high.  The counts come
+// from a bit-sliced adder over the input operations' words.
+//
+void LogicMatrix::CompileNetwork(const uint8_t* active, const uint8_t* inverted)
 {
-    InputVector result = m_defaultVector;
+    using namespace LogicMatrixConstants;
 
-    // Shift the bits of m_ordinal into the set positions of the co muted vector.
-    // This is run many times, so unrolling the loop actually helps.
-    //
-    // In GCC, the comment causes warnings to be supressed...
+    // Each pass compiles the operations whose operation inputs are all done.  Anything left after
+    // that is on a cycle, which the UI doesn't allow but a patch file could, and loses its
+    // operation inputs.
     //
-    switch (m_coMuteSize)
-    {
-        case 6:
-            result.Set(m_forwardingIndices[5], (m_ordinal & (1 << 5)) >> 5);
-            // fallthrough
-        case 5:
-            result.Set(m_forwardingIndices[4], (m_ordinal & (1 << 4)) >> 4);
-            // fallthrough
-        case 4:
-            result.Set(m_forwardingIndices[3], (m_ordinal & (1 << 3)) >> 3);
-            // fallthrough
-        case 3:
-            result.Set(m_forwardingIndices[2], (m_ordinal & (1 << 2)) >> 2);
-            // fallthrough
-        case 2:
-            result.Set(m_forwardingIndices[1], (m_ordinal & (1 << 1)) >> 1);
-            // fallthrough
-        case 1:
-            result.Set(m_forwardingIndices[0], (m_ordinal & (1 << 0)) >> 0);
-            // fallthrough
-        case 0:
-        default:
-            break;
+    uint8_t done = 0;
+    for (size_t pass = 0; pass <= x_numOperations; ++pass)
+    {
+        for (size_t i = 0; i < x_numOperations; ++i)
+        {
+            uint8_t operationInputs = m_paramsWatcher.m_state.m_operationInputs[i] & ~(1 << i) & ((1 << x_numOperations) - 1);
+            if (pass == x_numOperations)
+            {
+                operationInputs = 0;
+            }
+
+            if ((done >> i) & 1 || (operationInputs & ~done))
+            {
+                continue;
+            }
+
+            uint64_t count[3] = {};
+            size_t numOperationInputs = 0;
+            for (size_t j = 0; j < x_numOperations; ++j)
+            {
+                if ((operationInputs >> j) & 1)
+                {
+                    uint64_t carry = m_hot.m_outputWords[j];
+                    for (size_t b = 0; b < 3; ++b)
+                    {
+                        uint64_t sum = count[b] ^ carry;
+                        carry &= count[b];
+                        count[b] = sum;
+                    }
+
+                    ++numOperationInputs;
+                }
+            }
+
+            LogicOperation::Operator knobOperator = FloatToEnum<LogicOperation::Operator>(m_paramsWatcher.m_params[GetOperatorKnobId(i)]);
+            const uint64_t* truthTables = m_operations[i].Update(
+                m_paramsWatcher.m_state.m_definitions[i],
+                knobOperator,
+                InputVector(active[i]).CountSetBits(),
+                numOperationInputs);
+
+            uint64_t outputWord = 0;
+            for (size_t c = 0; c <= numOperationInputs; ++c)
+            {
+                uint64_t exactly = ~uint64_t(0);
+                for (size_t b = 0; b < 3; ++b)
+                {
+                    exactly &= ((c >> b) & 1) ? count[b] : ~count[b];
+                }
+
+                outputWord |= exactly & ExpandTruthTable(truthTables[c], active[i], inverted[i]);
+            }
+
+            m_hot.m_outputWords[i] = outputWord;
+            done |= 1 << i;
+        }
     }
+}
 
-    return result;
+void LogicMatrix::UpdateHotCVs()
+{
+    using namespace LogicMatrixConstants;
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        m_hot.m_intervalPitches[i] = x_intervalVoltages[m_hot.m_intervals[i]] + inputs[GetIntervalCVInputId(i)].getVoltage();
+
+        float percentile = m_paramsWatcher.m_params[GetPitchPercentileKnobId(i)] + inputs[GetPitchPercentileCVInputId(i)].getVoltage() / 5.0;
+        percentile = std::min(percentile, 1.f);
+        percentile = std::max(percentile, 0.f);
+        m_hot.m_percentiles[i] = percentile;
+    }
 }
 
-void LogicMatrix::InputVectorIterator::Next()
+void LogicMatrix::UpdatePolyPitch()
 {
-    ++m_ordinal;
+    using namespace LogicMatrixConstants;
+    using rack::simd::float_4;
+
+    // Recordings only hold channel 0 of the CVs, so replay is mono.
+    //
+    int channels = 1;
+    if (!m_player.IsPlaying())
+    {
+        for (size_t i = 0; i < x_numAccumulators; ++i)
+        {
+            channels = std::max(channels, inputs[GetIntervalCVInputId(i)].getChannels());
+        }
+    }
+
+    m_polyPitch.m_channels = channels;
+    if (channels == 1)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        float_4 interval = x_intervalVoltages[m_hot.m_intervals[i]];
+        rack::engine::Input& intervalCV = inputs[GetIntervalCVInputId(i)];
+        for (int c = 0; c < channels; c += 4)
+        {
+            m_polyPitch.m_intervalPitches[i][c / 4] = interval + intervalCV.getPolyVoltageSimd<float_4>(c);
+        }
+    }
 }
 
-bool LogicMatrix::InputVectorIterator::Done()
+// The accumulators whose interval CV moves them off the knob's ratio.  This goes by the
+// voltage rather than by whether a cable is patched, since replay writes recorded CV onto
+// unpatched inputs, and a patched input at 0V leaves the ratio as it is.
+//
+uint8_t LogicMatrix::GetOffsetIntervalCVs()
 {
-    return (1 << m_coMuteSize) <= m_ordinal;
+    using namespace LogicMatrixConstants;
+
+    uint8_t offset = 0;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        offset |= (inputs[GetIntervalCVInputId(i)].getVoltage() != 0.f) << i;
+    }
+
+    return offset;
 }
 
-constexpr float LogicMatrix::Accumulator::x_voltages[];
-constexpr int LogicMatrix::Accumulator::x_semitones[];
+// Equal keys are equal pitches.  The low bytes are the prime exponents of the ratio the
+// interval knobs make; six steps of at most four factors of a prime fit in a signed byte.
+// An accumulator with interval CV applied isn't a ratio, so its step count goes in the
+// bytes above instead.
+//
+uint64_t LogicMatrix::GetPitchKey(const MatrixEvalResult& result, const uint8_t* intervals, uint8_t offsetIntervalCVs)
+{
+    using namespace LogicMatrixConstants;
+
+    int exponents[Accumulator::x_numPrimes] = {};
+    uint64_t key = 0;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        if ((offsetIntervalCVs >> i) & 1)
+        {
+            key |= static_cast<uint64_t>(result.m_high[i]) << (8 * (Accumulator::x_numPrimes + i));
+            continue;
+        }
+
+        for (size_t j = 0; j < Accumulator::x_numPrimes; ++j)
+        {
+            exponents[j] += result.m_high[i] * Accumulator::x_primeExponents[intervals[i]][j];
+        }
+    }
+
+    for (size_t j = 0; j < Accumulator::x_numPrimes; ++j)
+    {
+        key |= static_cast<uint64_t>(static_cast<uint8_t>(exponents[j])) << (8 * j);
+    }
+
+    return key;
+}
 
-LogicMatrix::Accumulator::Interval
-LogicMatrix::Accumulator::GetInterval()
+// Keeps the first candidate for each pitch key, in order.  The survivor's own m_pitch is what
+// reaches the output.  A VoiceExpander collapses its voices' candidates the same way.
+//
+size_t LogicMatrix::CollapseDuplicatePitches(
+    MatrixEvalResult* results,
+    size_t numResults,
+    const uint8_t* intervals,
+    uint8_t offsetIntervalCVs)
 {
-    return FloatToEnum<Interval>(m_intervalKnob->getValue());
+    PitchKeySet keys;
+    size_t numDistinct = 0;
+    for (size_t i = 0; i < numResults; ++i)
+    {
+        size_t slot = keys.Insert(GetPitchKey(results[i], intervals, offsetIntervalCVs));
+        if (keys.m_counts[slot] == 1)
+        {
+            results[numDistinct++] = results[i];
+        }
+    }
+
+    return numDistinct;
 }
 
-float
-LogicMatrix::Accumulator::GetPitch()
+// The InputVectors a voice chooses between: every setting of its co-muted inputs, less any
+// outside its scale mask.
+//
+size_t LogicMatrix::GetCandidates(size_t outputId, InputVector defaultVector, uint8_t* candidates)
 {
-    return x_voltages[static_cast<size_t>(GetInterval())] + m_intervalCV->getVoltage();
+    using namespace LogicMatrixConstants;
+
+    size_t numResults = BitKernels::g_expandCoMuteSet(m_hot.m_coMuteVectors[outputId], defaultVector.m_bits, candidates);
+
+    // Drop candidates outside the voice's scale mask.  If that would leave nothing, the mask
+    // is ignored for this InputVector rather than silencing the voice.
+    //
+    uint64_t allowed = m_hot.m_allowedVectors[outputId];
+    if (allowed != ~uint64_t(0))
+    {
+        uint8_t filtered[1 << x_numInputs];
+        size_t numFiltered = 0;
+        for (size_t i = 0; i < numResults; ++i)
+        {
+            filtered[numFiltered] = candidates[i];
+            numFiltered += (allowed >> candidates[i]) & 1;
+        }
+
+        if (numFiltered > 0)
+        {
+            memcpy(candidates, filtered, numFiltered);
+            numResults = numFiltered;
+        }
+    }
+
+    return numResults;
 }
 
 LogicMatrix::MatrixEvalResult
-LogicMatrix::Output::ComputePitch(LogicMatrix* matrix, LogicMatrix::InputVector defaultVector)
+LogicMatrix::ComputePitch(
+    size_t outputId,
+    LogicMatrix::InputVector defaultVector,
+    CandidateDistribution::Voice* distribution)
 {
     using namespace LogicMatrixConstants;   
     
+    InputVector coMuteVector(m_hot.m_coMuteVectors[outputId]);
+    size_t coMuteSize = coMuteVector.CountSetBits();
+    m_tracer.Begin(Trace::Stage::ComputePitch, defaultVector.m_bits, coMuteSize);
+
+    uint8_t candidates[1 << x_numInputs];
+    size_t numResults = GetCandidates(outputId, defaultVector, candidates);
+
     MatrixEvalResult preResult[1 << x_numInputs];
-    InputVectorIterator itr = GetInputVectorIterator(defaultVector);
-    for (; !itr.Done(); itr.Next())
+    EvalMatrix(candidates, numResults, preResult);
+
+    if (m_paramsWatcher.m_state.m_distinctPitches)
     {
-        preResult[itr.m_ordinal] = matrix->EvalMatrix(itr.Get());
+        numResults = CollapseDuplicatePitches(preResult, numResults, m_hot.m_intervals, GetOffsetIntervalCVs());
     }
 
-    size_t numResults = itr.m_ordinal;
     std::sort(preResult, preResult + numResults);
 
-    float percentile = m_coMuteState.GetPercentile();
-    ssize_t ix = static_cast<size_t>(percentile * numResults);
-    ix = std::min<ssize_t>(ix, numResults - 1);
-    ix = std::max<ssize_t>(ix, 0);
+    float percentile = m_hot.m_percentiles[outputId];
+    int ix = static_cast<int>(percentile * numResults);
+    ix = std::min<int>(ix, numResults - 1);
+    ix = std::max<int>(ix, 0);
+
+    if (distribution)
+    {
+        for (size_t i = 0; i < numResults; ++i)
+        {
+            distribution->m_pitches[i] = preResult[i].m_pitch;
+        }
+
+        distribution->m_numCandidates = numResults;
+        distribution->m_selected = ix;
+    }
 
+    m_tracer.End(Trace::Stage::ComputePitch, defaultVector.m_bits, coMuteSize);
     return preResult[ix];
 }
 
+void LogicMatrix::AliasTable::Build(const uint8_t* candidates, const float* weights, size_t size)
+{
+    using namespace LogicMatrixConstants;
+
+    float total = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        total += weights[i];
+    }
+
+    // Scale so the average is one, then pair each underfull entry with an overfull one.
+    //
+    float scaled[1 << x_numInputs];
+    uint8_t small[1 << x_numInputs];
+    uint8_t large[1 << x_numInputs];
+    size_t numSmall = 0;
+    size_t numLarge = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        m_candidates[i] = candidates[i];
+        scaled[i] = weights[i] * size / total;
+        if (scaled[i] < 1)
+        {
+            small[numSmall++] = i;
+        }
+        else
+        {
+            large[numLarge++] = i;
+        }
+    }
+
+    while (numSmall > 0 && numLarge > 0)
+    {
+        uint8_t s = small[--numSmall];
+        uint8_t l = large[--numLarge];
+        m_probabilities[s] = scaled[s];
+        m_aliases[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1;
+        if (scaled[l] < 1)
+        {
+            small[numSmall++] = l;
+        }
+        else
+        {
+            large[numLarge++] = l;
+        }
+    }
+
+    // Whatever is left is one up to rounding.
+    //
+    while (numLarge > 0)
+    {
+        uint8_t l = large[--numLarge];
+        m_probabilities[l] = 1;
+        m_aliases[l] = l;
+    }
+
+    while (numSmall > 0)
+    {
+        uint8_t s = small[--numSmall];
+        m_probabilities[s] = 1;
+        m_aliases[s] = s;
+    }
+
+    m_size = size;
+}
+
+// A random voice's distribution is its candidates as percentile mode sees them, with the one
+// drawn marked instead of the one at the percentile.  With distinct pitches the drawn
+// candidate can reach its pitch by another route than the one kept, so mark the nearest.
+//
+void LogicMatrix::MarkDrawnPitch(
+    size_t outputId,
+    InputVector defaultVector,
+    float pitch,
+    CandidateDistribution::Voice* distribution)
+{
+    ComputePitch(outputId, defaultVector, distribution);
+    for (size_t i = 0; i < distribution->m_numCandidates; ++i)
+    {
+        if (std::fabs(distribution->m_pitches[i] - pitch) < std::fabs(distribution->m_pitches[distribution->m_selected] - pitch))
+        {
+            distribution->m_selected = i;
+        }
+    }
+}
+
+LogicMatrix::MatrixEvalResult
+LogicMatrix::ComputeRandomPitch(size_t outputId, InputVector defaultVector, bool newStep)
+{
+    using namespace LogicMatrixConstants;
+
+    AliasTable& table = m_aliasTables[outputId];
+    if (newStep)
+    {
+        // The candidate set only depends on the inputs that aren't co-muted.
+        //
+        Selection selection = m_paramsWatcher.m_state.m_selections[outputId];
+        uint8_t key = defaultVector.m_bits & ~m_hot.m_coMuteVectors[outputId];
+        uint8_t offsetIntervalCVs = GetOffsetIntervalCVs();
+        if (!table.m_valid ||
+            key != table.m_key ||
+            offsetIntervalCVs != table.m_offsetIntervalCVs ||
+            m_paramsWatcher.m_generation != table.m_paramsGeneration ||
+            selection != table.m_selection)
+        {
+            uint8_t candidates[1 << x_numInputs];
+            size_t numCandidates = GetCandidates(outputId, defaultVector, candidates);
+
+            float weights[1 << x_numInputs];
+            for (size_t i = 0; i < numCandidates; ++i)
+            {
+                weights[i] = 1;
+            }
+
+            // For an even chance per lattice point, split each point's weight between the
+            // candidates that land on it.  With distinct pitches, the same per pitch.
+            //
+            if (selection == Selection::Random && m_paramsWatcher.m_state.m_distinctPitches)
+            {
+                MatrixEvalResult results[1 << x_numInputs];
+                EvalMatrix(candidates, numCandidates, results);
+
+                PitchKeySet keys;
+                uint8_t slots[1 << x_numInputs];
+                for (size_t i = 0; i < numCandidates; ++i)
+                {
+                    slots[i] = keys.Insert(GetPitchKey(results[i], m_hot.m_intervals, offsetIntervalCVs));
+                }
+
+                for (size_t i = 0; i < numCandidates; ++i)
+                {
+                    weights[i] = 1.f / keys.m_counts[slots[i]];
+                }
+            }
+            else if (selection == Selection::Random)
+            {
+                static constexpr size_t x_extent = LatticeIndex::x_extent;
+
+                MatrixEvalResult results[1 << x_numInputs];
+                EvalMatrix(candidates, numCandidates, results);
+
+                uint8_t counts[x_extent * x_extent * x_extent] = {};
+                for (size_t i = 0; i < numCandidates; ++i)
+                {
+                    const uint8_t* position = results[i].m_high;
+                    ++counts[(position[0] * x_extent + position[1]) * x_extent + position[2]];
+                }
+
+                for (size_t i = 0; i < numCandidates; ++i)
+                {
+                    const uint8_t* position = results[i].m_high;
+                    weights[i] = 1.f / counts[(position[0] * x_extent + position[1]) * x_extent + position[2]];
+                }
+            }
+
+            table.Build(candidates, weights, numCandidates);
+            table.m_valid = true;
+            table.m_key = key;
+            table.m_offsetIntervalCVs = offsetIntervalCVs;
+            table.m_paramsGeneration = m_paramsWatcher.m_generation;
+            table.m_selection = selection;
+        }
+
+        // Each step gets one draw, and the step is the InputVector changing.  The trigger
+        // can't stand in for it, since it fires on the pitch change the draw makes.
+        //
+        table.m_drawn = table.Draw(m_rng);
+    }
+
+    MatrixEvalResult result;
+    EvalMatrix(&table.m_drawn, 1, &result);
+    return result;
+}
+
 LogicMatrix::LogicMatrix()
 {
     using namespace LogicMatrixConstants;   
@@ -230,17 +732,15 @@ LogicMatrix::LogicMatrix()
         for (size_t j = 0; j < x_numOperations; ++j)
         {
             configParam(GetMatrixSwitchId(i, j), 0.f, 2.f, 1.f, "");
-            m_operations[j].m_elements[i].Init(&params[GetMatrixSwitchId(i, j)]);
         }
 
         for (size_t j = 0; j < x_numAccumulators; ++j)
         {
             configParam(GetPitchCoMuteSwitchId(i, j), 0.f, 1.f, 1.f, "Co-Mute Switch " + std::to_string(i) + "," + std::to_string(j));
-            m_outputs[j].m_coMuteState.m_switches[i].Init(
-                &params[GetPitchCoMuteSwitchId(i, j)]);
         }
 
-        m_inputs[i].Init(
+        m_inputStage.Init(
+            i,
             &inputs[GetMainInputId(i)],
             &lights[GetInputLightId(i)]);
     }
@@ -252,8 +752,6 @@ LogicMatrix::LogicMatrix()
         configOutput(GetOperationOutputId(i), "Logic Out " + std::to_string(i));
 
         m_operations[i].Init(
-            &params[GetOperationSwitchId(i)],
-            &params[GetOperatorKnobId(i)],
             &outputs[GetOperationOutputId(i)],
             &lights[GetOperationLightId(i)]);
     }
@@ -269,71 +767,817 @@ LogicMatrix::LogicMatrix()
         configOutput(GetMainOutputId(i), "Pitch Out " + std::to_string(i));
         configOutput(GetTriggerOutputId(i), "Trigger " + std::to_string(i));
 
-        m_accumulators[i].Init(
-            &params[GetAccumulatorIntervalKnobId(i)],
-            &inputs[GetIntervalCVInputId(i)]);
-
         m_outputs[i].Init(
             &outputs[GetMainOutputId(i)],
             &outputs[GetTriggerOutputId(i)],
-            &lights[GetTriggerLightId(i)],
-            &params[GetPitchPercentileKnobId(i)],
-            &inputs[GetPitchPercentileCVInputId(i)]);
+            &lights[GetTriggerLightId(i)]);
     }
 
     rightExpander.producerMessage = m_rightMessages[0];
     rightExpander.consumerMessage = m_rightMessages[1];
+    leftExpander.producerMessage = m_leftMessages[0];
+    leftExpander.consumerMessage = m_leftMessages[1];
+
+    ApplyLightDivision();
+    m_paramsCheckDivider.setDivision(x_paramsCheckDivision);
+    for (std::atomic<int>& selection : m_selections)
+    {
+        selection.store(static_cast<int>(Selection::Percentile), std::memory_order_relaxed);
+    }
+
+    m_seed.store(rack::random::u32(), std::memory_order_relaxed);
 }
 
 LogicMatrix::InputVector
-LogicMatrix::ProcessInputs()
+LogicMatrix::ProcessInputs(int64_t frame)
 {
-    using namespace LogicMatrixConstants;
+    return m_inputStage.Process(frame);
+}
 
-    InputVector result;
-    for (size_t i = 0; i < x_numInputs; ++i)
+// Unpatched inputs take the left LogicMatrix's inputs or logic outputs instead of the divide-by-two chain.
+//
+LogicMatrix::InputVector
+LogicMatrix::ApplyChain(InputVector inputVector)
+{
+    ChainMode chainMode = GetChainMode();
+    if (chainMode == ChainMode::Off ||
+        !leftExpander.module ||
+        leftExpander.module->model != modelLogicMatrix)
+    {
+        return inputVector;
+    }
+
+    ChainMessage* msg = static_cast<ChainMessage*>(leftExpander.consumerMessage);
+    if (!msg->m_valid)
     {
-        m_inputs[i].SetValue(i > 0 ? &m_inputs[i - 1] : nullptr);
-        result.Set(i, m_inputs[i].m_value);
+        return inputVector;
     }
 
+    uint8_t chained = chainMode == ChainMode::LeftInputs ? msg->m_inputVector : msg->m_operationBits;
+    uint8_t connected = m_inputStage.m_connected.m_bits;
+    InputVector result((inputVector.m_bits & connected) | (chained & ~connected & ((1 << LogicMatrixConstants::x_numInputs) - 1)));
+    m_inputStage.m_lightLatch.m_bits |= result.m_bits;
     return result;
 }
 
-void LogicMatrix::ProcessOperations(InputVector defaultVector)
+uint8_t LogicMatrix::ProcessOperations(InputVector defaultVector)
 {
     using namespace LogicMatrixConstants;
     
+    uint8_t operationBits = 0;
     for (size_t i = 0; i < x_numOperations; ++i)
     {
-        m_operations[i].SetBitVectors();
-        bool value = m_operations[i].GetValue(defaultVector);
+        bool value = m_hot.GetValue(i, defaultVector.m_bits);
         m_operations[i].SetOutput(value);
+        operationBits |= value << i;
     }
+
+    return operationBits;
 }
 
-void LogicMatrix::ProcessOutputs(InputVector defaultVector, float dt)
+bool LogicMatrix::CanUseSequenceTable()
 {
     using namespace LogicMatrixConstants;
 
-    LatticeExpanderMessage msg;
+    // Replay writes recorded voltages straight onto the CV inputs, patched or not.
+    //
+    if (m_player.IsPlaying())
+    {
+        return false;
+    }
 
     for (size_t i = 0; i < x_numAccumulators; ++i)
     {
-        MatrixEvalResult res = m_outputs[i].ComputePitch(this, defaultVector);
-        m_outputs[i].SetPitch(res.m_pitch, dt);
-        for (size_t j = 0; j < x_numAccumulators; ++j)
+        if (inputs[GetPitchPercentileCVInputId(i)].isConnected() ||
+            inputs[GetIntervalCVInputId(i)].isConnected())
         {
-            msg.m_position[i][j] = res.m_high[j];
+            return false;
         }
     }
 
-    SendExpanderMessage(msg);
+    return true;
 }
 
-void LogicMatrix::process(const ProcessArgs& args)
+// Latches params and the module state every few samples, and rebuilds the hot state if they
+// moved.  Replay applies each param change on the sample it was recorded on, so it checks every
+// sample, as does the first sample after the module is created.
+//
+void LogicMatrix::UpdateParamsGeneration()
+{
+    if (m_paramsCheckDivider.process() || m_player.IsPlaying() || m_hot.m_paramsGeneration == 0)
+    {
+        CheckParams();
+    }
+
+    if (m_hot.m_paramsGeneration != m_paramsWatcher.m_generation)
+    {
+        UpdateHotState();
+    }
+}
+
+void LogicMatrix::CheckParams()
 {
-    InputVector defaultVector = ProcessInputs();
-    ProcessOperations(defaultVector);
-    ProcessOutputs(defaultVector, args.sampleTime);
+    using namespace LogicMatrixConstants;
+
+    bool changed = false;
+    for (size_t i = 0; i < GetNumParams(); ++i)
+    {
+        float value = params[i].getValue();
+        if (value != m_paramsWatcher.m_params[i])
+        {
+            m_paramsWatcher.m_params[i] = value;
+            changed = true;
+        }
+    }
+
+    // A definition caught mid-write is picked up on a later sample.
+    //
+    ModuleState uiState;
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        m_operations[i].m_definition.Read(&m_paramsWatcher.m_uiDefinitions[i], &m_paramsWatcher.m_definitionGenerations[i]);
+        uiState.m_definitions[i] = m_paramsWatcher.m_uiDefinitions[i];
+        uiState.m_operationInputs[i] = m_operations[i].GetOperationInputs();
+    }
+
+    uiState.m_distinctPitches = m_distinctPitches.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        uiState.m_selections[i] = GetSelection(i);
+    }
+
+    if (rightExpander.module && rightExpander.module->model == modelLatticeExpander)
+    {
+        LatticeMaskMessage* maskMessage = static_cast<LatticeMaskMessage*>(rightExpander.consumerMessage);
+        for (size_t i = 0; i < x_numAccumulators; ++i)
+        {
+            uiState.m_cellMasks[i] = maskMessage->m_cellMasks[i];
+        }
+    }
+
+    // The UI's state comes back once replay is over.
+    //
+    const ModuleState& state = m_player.IsPlaying() ? m_replayState : uiState;
+    if (state != m_paramsWatcher.m_state)
+    {
+        m_paramsWatcher.m_state = state;
+        changed = true;
+    }
+
+    if (changed)
+    {
+        ++m_paramsWatcher.m_generation;
+    }
+}
+
+// A voice is only evaluated if its pitch or trigger jack is patched, or the expander is showing
+// it.  Replay listens to the voices the recording did, whatever is patched now.
+//
+uint8_t LogicMatrix::GetListenedVoices()
+{
+    using namespace LogicMatrixConstants;
+
+    if (m_player.IsPlaying())
+    {
+        return m_replayListened;
+    }
+
+    bool expanderAttached = rightExpander.module && rightExpander.module->model == modelLatticeExpander;
+    uint8_t listened = 0;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        listened |= (expanderAttached || m_outputs[i].IsConnected()) << i;
+    }
+
+    return listened;
+}
+
+void LogicMatrix::ProcessOutputs(InputVector defaultVector, uint8_t listened, bool lightTick, float dt)
+{
+    using namespace LogicMatrixConstants;
+
+    LatticeExpanderMessage msg;
+
+    bool useSequenceTable = CanUseSequenceTable();
+    if (!useSequenceTable || m_sequenceTable.m_paramsGeneration != m_paramsWatcher.m_generation)
+    {
+        m_sequenceTable.Invalidate();
+        m_sequenceTable.m_paramsGeneration = m_paramsWatcher.m_generation;
+    }
+
+    bool cvsUpdated = false;
+    UpdatePolyPitch();
+
+    // When the distribution is due, the candidates come from this sample's evaluation.  Voices
+    // that evaluation skips (cached, random or idle) are worked out for it then, and only then.
+    //
+    CandidateDistribution* distribution = nullptr;
+    if (lightTick &&
+        m_distributionDisplayed.load(std::memory_order_relaxed) &&
+        (!useSequenceTable ||
+         defaultVector.m_bits != m_distributionVector.m_bits ||
+         m_paramsWatcher.m_generation != m_distributionParamsGeneration))
+    {
+        m_distributionVector = defaultVector;
+        m_distributionParamsGeneration = m_paramsWatcher.m_generation;
+        distribution = &m_distribution.BeginWrite();
+        UpdateHotCVs();
+        cvsUpdated = true;
+    }
+
+    // Random voices depend on more than the InputVector, so they don't go in the sequence table.
+    //
+    bool newStep = defaultVector.m_bits != m_lastStepVector;
+    m_lastStepVector = defaultVector.m_bits;
+    MatrixEvalResult randomResult;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        Output& output = m_outputs[i];
+        CandidateDistribution::Voice* voiceDistribution = distribution ? &distribution->m_voices[i] : nullptr;
+        if (!((listened >> i) & 1))
+        {
+            output.m_active = false;
+            if (voiceDistribution)
+            {
+                ComputePitch(i, defaultVector, voiceDistribution);
+            }
+
+            continue;
+        }
+
+        bool resync = !output.m_active;
+        output.m_active = true;
+
+        bool isRandom = m_paramsWatcher.m_state.m_selections[i] != Selection::Percentile;
+        bool cached = !isRandom && !voiceDistribution && useSequenceTable && m_sequenceTable.IsValid(defaultVector, i);
+        if (!cached && !cvsUpdated)
+        {
+            UpdateHotCVs();
+            cvsUpdated = true;
+        }
+
+        MatrixEvalResult* resPtr = &m_sequenceTable.m_results[defaultVector.m_bits][i];
+        if (isRandom)
+        {
+            randomResult = ComputeRandomPitch(i, defaultVector, newStep || resync);
+            resPtr = &randomResult;
+            if (voiceDistribution)
+            {
+                MarkDrawnPitch(i, defaultVector, randomResult.m_pitch, voiceDistribution);
+            }
+        }
+        else if (!cached)
+        {
+            *resPtr = ComputePitch(i, defaultVector, voiceDistribution);
+            if (useSequenceTable)
+            {
+                m_sequenceTable.SetValid(defaultVector, i);
+            }
+        }
+
+        MatrixEvalResult& res = *resPtr;
+
+        if (resync)
+        {
+            output.Resync(res.m_pitch);
+        }
+        else
+        {
+            output.SetPitch(res.m_pitch, dt);
+        }
+
+        if (m_polyPitch.m_channels > 1 || output.m_channels > 1)
+        {
+            rack::simd::float_4 pitches[PORT_MAX_CHANNELS / 4];
+            m_polyPitch.GetPitches(res.m_high, pitches);
+            output.SetChannelPitches(pitches, m_polyPitch.m_channels);
+        }
+
+        for (size_t j = 0; j < x_numAccumulators; ++j)
+        {
+            msg.m_position[i][j] = res.m_high[j];
+        }
+    }
+
+    if (distribution)
+    {
+        m_distribution.EndWrite();
+    }
+
+    msg.m_inputVector = defaultVector.m_bits;
+    msg.m_edgeFrame = m_latency.m_running ? m_latency.m_lastEdge : -1;
+
+    m_tracer.Begin(Trace::Stage::SendExpanderMessage, defaultVector.m_bits);
+    SendExpanderMessage(&msg);
+    m_tracer.End(Trace::Stage::SendExpanderMessage, defaultVector.m_bits);
+}
+
+// Edges are taken where they come in: a patched input crossing its threshold, as stamped by the
+// input stage, or the unpatched inputs changing, which follow the left LogicMatrix when chained
+// (and otherwise only move with a patched input or a cable).  Replay has no gates to cross, so
+// there the recorded InputVector changing is the edge.
+//
+void LogicMatrix::MeasureEdges(int64_t frame, InputVector defaultVector)
+{
+    if (m_player.IsPlaying())
+    {
+        m_latency.ObserveInput(frame, defaultVector.m_bits);
+        return;
+    }
+
+    m_latency.ObserveInput(frame, defaultVector.m_bits & ~m_inputStage.m_connected.m_bits);
+    if (m_inputStage.m_lastCrossing == frame && m_latency.m_lastEdge != frame)
+    {
+        m_latency.OnEdge(frame);
+    }
+}
+
+// Outputs are set on the same sample as the input crossing that moves them, so everything here
+// should measure zero.  The lattice hop is measured on the LatticeExpander.
+//
+void LogicMatrix::MeasureLatency(int64_t frame, uint8_t operationBits)
+{
+    using namespace LogicMatrixConstants;
+
+    uint32_t numPitchChanges = 0;
+    uint32_t numTriggers = 0;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        numPitchChanges += m_outputs[i].m_numPitchChanges;
+        numTriggers += m_outputs[i].m_numTriggers;
+    }
+
+    m_latency.Observe(Latency::Path::LogicOut, frame, operationBits);
+    m_latency.Observe(Latency::Path::PitchOut, frame, numPitchChanges);
+    m_latency.Observe(Latency::Path::Trigger, frame, numTriggers);
+}
+
+void LogicMatrix::ProcessLatticeIndex(bool lightTick)
+{
+    using namespace LogicMatrixConstants;
+
+    if (!rightExpander.module || rightExpander.module->model != modelLatticeExpander)
+    {
+        return;
+    }
+
+    LatticeIndexBuilder& builder = m_latticeIndexBuilder;
+    bool cvsMove = !CanUseSequenceTable();
+    if (builder.m_paramsGeneration != m_paramsWatcher.m_generation)
+    {
+        builder.Restart(m_paramsWatcher.m_generation, cvsMove);
+    }
+
+    // Evaluating goes through the sequence table, so it is filled ahead of time as a side effect.
+    // Passes that only follow CV step on light ticks, as the index is only for display and the
+    // evaluation is not cached while CV is patched.
+    //
+    if (builder.m_next < (1 << x_numInputs))
+    {
+        if (builder.m_builtWithCVs && !lightTick)
+        {
+            return;
+        }
+
+        InputVector inputVector(builder.m_next++);
+        bool useSequenceTable = CanUseSequenceTable();
+        UpdateHotCVs();
+        for (size_t i = 0; i < x_numAccumulators; ++i)
+        {
+            MatrixEvalResult& res = m_sequenceTable.m_results[inputVector.m_bits][i];
+            if (!useSequenceTable || !m_sequenceTable.IsValid(inputVector, i))
+            {
+                res = ComputePitch(i, inputVector);
+            }
+
+            if (useSequenceTable)
+            {
+                m_sequenceTable.SetValid(inputVector, i);
+            }
+
+            builder.m_index.Add(i, res.m_high, inputVector.m_bits);
+        }
+
+        return;
+    }
+
+    if (builder.m_sentTo != rightExpander.module->id)
+    {
+        LatticeExpander* expander = static_cast<LatticeExpander*>(rightExpander.module);
+        expander->m_index.BeginWrite() = builder.m_index;
+        expander->m_index.EndWrite();
+        builder.m_sentTo = rightExpander.module->id;
+    }
+
+    // Patched CV moves the pitches, and with them which candidate each voice picks, without
+    // moving the params generation.  While any is patched (or a recording is replaying onto
+    // them) the index is rebuilt back to back, so it is never more than one pass behind, and
+    // once more after the last is unpatched.
+    //
+    if (cvsMove || builder.m_builtWithCVs)
+    {
+        builder.Restart(m_paramsWatcher.m_generation, cvsMove);
+    }
+}
+
+void LogicMatrix::ProcessLights(float dt)
+{
+    using namespace LogicMatrixConstants;
+
+    m_inputStage.SetLights();
+
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        m_operations[i].SetLight();
+    }
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        m_outputs[i].SetLight(dt);
+    }
+}
+
+// Records what the params watcher latched this sample, which is what evaluation reads.
+//
+void LogicMatrix::RecordSample(InputVector inputVector, uint8_t listened, float sampleRate)
+{
+    using namespace LogicMatrixConstants;
+    using Recording::Record;
+
+    if (!m_recorder.BeginPushes())
+    {
+        return;
+    }
+
+    Record record;
+    memset(&record, 0, sizeof(Record));
+
+    // Everything needed to restart the engine from here, written once when recording starts.
+    //
+    if (m_recorder.m_needsState)
+    {
+        record.m_type = Record::Type::State;
+        for (size_t i = 0; i < x_numAccumulators; ++i)
+        {
+            record.m_values[i] = m_outputs[i].m_pitch;
+            record.m_values[x_numAccumulators + i] = m_outputs[i].m_pulseGen.remaining;
+            record.m_inputVector |= m_outputs[i].m_active << i;
+        }
+
+        record.m_values[2 * x_numAccumulators] = sampleRate;
+        m_recorder.Push(record);
+    }
+
+    // Where the random sequence is, so replay draws the same candidates.
+    //
+    if (m_recorder.m_needsState || m_recorder.m_needsRandom)
+    {
+        memset(&record, 0, sizeof(Record));
+        record.m_type = Record::Type::Random;
+        for (size_t i = 0; i < 2; ++i)
+        {
+            record.m_words[2 * i] = static_cast<uint32_t>(m_rng.state[i]);
+            record.m_words[2 * i + 1] = static_cast<uint32_t>(m_rng.state[i] >> 32);
+        }
+
+        record.m_words[4] = m_seed.load(std::memory_order_relaxed);
+        record.m_words[5] = static_cast<uint8_t>(m_lastStepVector);
+        for (size_t i = 0; i < x_numAccumulators; ++i)
+        {
+            record.m_words[5] |= static_cast<uint32_t>(m_aliasTables[i].m_drawn) << (8 * (i + 1));
+        }
+
+        m_recorder.Push(record);
+    }
+
+    m_recorder.m_needsRandom = false;
+
+    const ModuleState& state = m_paramsWatcher.m_state;
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        const LogicOperation::OperatorDefinition& definition = state.m_definitions[i];
+        memset(&record, 0, sizeof(Record));
+        record.m_type = Record::Type::Operator;
+        record.m_paramId = i;
+        record.m_words[0] = static_cast<uint32_t>(definition.m_truthTable);
+        record.m_words[1] = static_cast<uint32_t>(definition.m_truthTable >> 32);
+        record.m_words[2] = static_cast<uint32_t>(definition.m_type);
+        record.m_words[3] = definition.m_k;
+        record.m_words[4] = state.m_operationInputs[i];
+        m_recorder.PushIfChanged(record, &m_recorder.m_lastOperators[i]);
+    }
+
+    memset(&record, 0, sizeof(Record));
+    record.m_type = Record::Type::Candidates;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        record.m_words[2 * i] = static_cast<uint32_t>(state.m_cellMasks[i]);
+        record.m_words[2 * i + 1] = static_cast<uint32_t>(state.m_cellMasks[i] >> 32);
+    }
+
+    record.m_words[2 * x_numAccumulators] = state.m_distinctPitches;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        record.m_words[2 * x_numAccumulators] |= static_cast<uint32_t>(state.m_selections[i]) << (8 * (i + 1));
+    }
+
+    m_recorder.PushIfChanged(record, &m_recorder.m_lastCandidates);
+
+    memset(&record, 0, sizeof(Record));
+    record.m_type = Record::Type::Param;
+    for (size_t i = 0; i < GetNumParams(); ++i)
+    {
+        float value = m_paramsWatcher.m_params[i];
+        if (m_recorder.m_needsState || value != m_recorder.m_lastParams[i])
+        {
+            record.m_paramId = i;
+            record.m_values[0] = value;
+            m_recorder.Push(record);
+            m_recorder.m_lastParams[i] = value;
+        }
+    }
+
+    m_recorder.m_needsState = false;
+
+    record.m_type = Record::Type::Sample;
+    record.m_paramId = 0;
+    record.m_inputVector = inputVector.m_bits;
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        record.m_values[i] = inputs[GetPitchPercentileCVInputId(i)].getVoltage();
+        record.m_values[x_numAccumulators + i] = inputs[GetIntervalCVInputId(i)].getVoltage();
+    }
+
+    record.m_words[2 * x_numAccumulators] = listened;
+    m_recorder.Push(record);
+    m_recorder.EndPushes();
+}
+
+// Feeds the next recorded sample through the engine in place of the real inputs.
+// Returns false when not replaying, or once the recording has run out.
+//
+bool LogicMatrix::ReplaySample(InputVector* inputVector, float* sampleTime)
+{
+    using namespace LogicMatrixConstants;
+    using Recording::Record;
+
+    if (!m_player.IsPlaying())
+    {
+        return false;
+    }
+
+    const Record* record = m_player.Next();
+    while (record && record->m_type != Record::Type::Sample)
+    {
+        if (record->m_type == Record::Type::Param && record->m_paramId < GetNumParams())
+        {
+            params[record->m_paramId].setValue(record->m_values[0]);
+        }
+        else if (record->m_type == Record::Type::State)
+        {
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                m_outputs[i].m_pitch = record->m_values[i];
+                m_outputs[i].m_pulseGen.remaining = record->m_values[x_numAccumulators + i];
+                m_outputs[i].m_active = (record->m_inputVector >> i) & 1;
+            }
+
+            m_replaySampleTime = 1.f / record->m_values[2 * x_numAccumulators];
+        }
+        else if (record->m_type == Record::Type::Random)
+        {
+            for (size_t i = 0; i < 2; ++i)
+            {
+                m_rng.state[i] = record->m_words[2 * i] | (static_cast<uint64_t>(record->m_words[2 * i + 1]) << 32);
+            }
+
+            // Carry on with the candidates recording had drawn, and rebuild the tables on the
+            // next step.  Building is deterministic, so they come out the same.
+            //
+            uint8_t lastStepVector = static_cast<uint8_t>(record->m_words[5]);
+            m_lastStepVector = lastStepVector < (1 << x_numInputs) ? lastStepVector : -1;
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                m_aliasTables[i].m_valid = false;
+                m_aliasTables[i].m_drawn = static_cast<uint8_t>(record->m_words[5] >> (8 * (i + 1))) % (1 << x_numInputs);
+            }
+        }
+        else if (record->m_type == Record::Type::Operator && record->m_paramId < x_numOperations)
+        {
+            typedef LogicOperation::OperatorDefinition::Type DefinitionType;
+
+            LogicOperation::OperatorDefinition& definition = m_replayState.m_definitions[record->m_paramId];
+            definition.m_truthTable = record->m_words[0] | (static_cast<uint64_t>(record->m_words[1]) << 32);
+            definition.m_type = static_cast<DefinitionType>(std::min<uint32_t>(record->m_words[2], static_cast<uint32_t>(DefinitionType::NumTypes) - 1));
+            definition.m_k = static_cast<uint8_t>(std::min<uint32_t>(record->m_words[3], x_maxOperatorK));
+            m_replayState.m_operationInputs[record->m_paramId] = static_cast<uint8_t>(record->m_words[4]);
+        }
+        else if (record->m_type == Record::Type::Candidates)
+        {
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                m_replayState.m_cellMasks[i] = record->m_words[2 * i] | (static_cast<uint64_t>(record->m_words[2 * i + 1]) << 32);
+            }
+
+            uint32_t word = record->m_words[2 * x_numAccumulators];
+            m_replayState.m_distinctPitches = (word & 0xff) != 0;
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                uint32_t selection = (word >> (8 * (i + 1))) & 0xff;
+                m_replayState.m_selections[i] = static_cast<Selection>(std::min<uint32_t>(selection, static_cast<uint32_t>(Selection::NumSelections) - 1));
+            }
+        }
+
+        record = m_player.Next();
+    }
+
+    if (!record)
+    {
+        // Don't leave replayed voltages behind on unpatched CV inputs.
+        //
+        for (size_t i = 0; i < x_numAccumulators; ++i)
+        {
+            if (!inputs[GetPitchPercentileCVInputId(i)].isConnected())
+            {
+                inputs[GetPitchPercentileCVInputId(i)].setVoltage(0.f);
+            }
+
+            if (!inputs[GetIntervalCVInputId(i)].isConnected())
+            {
+                inputs[GetIntervalCVInputId(i)].setVoltage(0.f);
+            }
+        }
+
+        m_player.Finish();
+        return false;
+    }
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        inputs[GetPitchPercentileCVInputId(i)].setVoltage(record->m_values[i]);
+        inputs[GetIntervalCVInputId(i)].setVoltage(record->m_values[x_numAccumulators + i]);
+    }
+
+    m_replayListened = static_cast<uint8_t>(record->m_words[2 * x_numAccumulators]);
+    *inputVector = InputVector(record->m_inputVector);
+    *sampleTime = m_replaySampleTime;
+    m_inputStage.m_lightLatch.m_bits |= inputVector->m_bits;
+    return true;
+}
+
+void LogicMatrix::process(const ProcessArgs& args)
+{
+    // Replay restores the generator itself, so a reseed waits until it is over.
+    //
+    if (!m_player.IsPlaying() && m_reseedRequested.exchange(false))
+    {
+        ResetRandom();
+    }
+
+    ApplyLightDivision();
+
+    InputVector defaultVector;
+    float sampleTime = args.sampleTime;
+    if (!ReplaySample(&defaultVector, &sampleTime))
+    {
+        m_tracer.Begin(Trace::Stage::ProcessInputs, m_inputStage.m_values.m_bits);
+        defaultVector = ApplyChain(ProcessInputs(args.frame));
+        m_tracer.End(Trace::Stage::ProcessInputs, defaultVector.m_bits);
+    }
+
+    UpdateParamsGeneration();
+    uint8_t listened = GetListenedVoices();
+    RecordSample(defaultVector, listened, args.sampleRate);
+
+    m_tracer.Begin(Trace::Stage::ProcessOperations, defaultVector.m_bits);
+    uint8_t operationBits = ProcessOperations(defaultVector);
+    m_tracer.End(Trace::Stage::ProcessOperations, defaultVector.m_bits);
+
+    SendChainMessage(defaultVector, operationBits);
+
+    bool measuring = m_latency.Begin();
+    if (measuring)
+    {
+        MeasureEdges(args.frame, defaultVector);
+    }
+
+    bool lightTick = m_lightDivider.process();
+    ProcessOutputs(defaultVector, listened, lightTick, sampleTime);
+    if (measuring)
+    {
+        MeasureLatency(args.frame, operationBits);
+    }
+
+    SendVoiceExpanderMessage(defaultVector);
+    ProcessLatticeIndex(lightTick);
+
+    if (lightTick)
+    {
+        ProcessLights(args.sampleTime * m_lightDivider.getDivision());
+    }
+}
+
+json_t* LogicMatrix::dataToJson()
+{
+    using namespace LogicMatrixConstants;
+
+    json_t* rootJ = json_object();
+    json_object_set_new(rootJ, "lightDivisionIndex", json_integer(m_lightDivisionIndex.load()));
+    json_object_set_new(rootJ, "chainMode", json_integer(m_chainMode.load()));
+    json_object_set_new(rootJ, "seed", json_integer(m_seed.load()));
+    json_object_set_new(rootJ, "distinctPitches", json_boolean(m_distinctPitches.load()));
+
+    json_t* selectionsJ = json_array();
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        json_array_append_new(selectionsJ, json_integer(m_selections[i].load()));
+    }
+
+    json_object_set_new(rootJ, "selections", selectionsJ);
+
+    json_t* operatorsJ = json_array();
+    for (size_t i = 0; i < x_numOperations; ++i)
+    {
+        LogicOperation::OperatorDefinition definition = m_operations[i].GetDefinition();
+        char truthTable[17];
+        snprintf(truthTable, sizeof(truthTable), "%016llx", static_cast<unsigned long long>(definition.m_truthTable));
+
+        json_t* operatorJ = json_object();
+        json_object_set_new(operatorJ, "type", json_integer(static_cast<int>(definition.m_type)));
+        json_object_set_new(operatorJ, "k", json_integer(definition.m_k));
+        json_object_set_new(operatorJ, "truthTable", json_string(truthTable));
+        json_object_set_new(operatorJ, "operationInputs", json_integer(m_operations[i].GetOperationInputs()));
+        json_array_append_new(operatorsJ, operatorJ);
+    }
+
+    json_object_set_new(rootJ, "operators", operatorsJ);
+    return rootJ;
+}
+
+void LogicMatrix::dataFromJson(json_t* rootJ)
+{
+    using namespace LogicMatrixConstants;
+
+    json_t* lightDivisionJ = json_object_get(rootJ, "lightDivisionIndex");
+    if (lightDivisionJ)
+    {
+        SetLightDivisionIndex(json_integer_value(lightDivisionJ));
+    }
+
+    json_t* chainModeJ = json_object_get(rootJ, "chainMode");
+    if (chainModeJ)
+    {
+        int chainMode = json_integer_value(chainModeJ);
+        if (0 <= chainMode && chainMode < static_cast<int>(ChainMode::NumModes))
+        {
+            SetChainMode(static_cast<ChainMode>(chainMode));
+        }
+    }
+
+    json_t* seedJ = json_object_get(rootJ, "seed");
+    if (seedJ)
+    {
+        m_seed.store(static_cast<uint32_t>(json_integer_value(seedJ)));
+    }
+
+    m_reseedRequested.store(true);
+
+    json_t* distinctPitchesJ = json_object_get(rootJ, "distinctPitches");
+    if (distinctPitchesJ)
+    {
+        m_distinctPitches.store(json_boolean_value(distinctPitchesJ));
+    }
+
+    json_t* selectionsJ = json_object_get(rootJ, "selections");
+    for (size_t i = 0; selectionsJ && i < x_numAccumulators && i < json_array_size(selectionsJ); ++i)
+    {
+        int selection = json_integer_value(json_array_get(selectionsJ, i));
+        if (0 <= selection && selection < static_cast<int>(Selection::NumSelections))
+        {
+            SetSelection(i, static_cast<Selection>(selection));
+        }
+    }
+
+    json_t* operatorsJ = json_object_get(rootJ, "operators");
+    for (size_t i = 0; operatorsJ && i < x_numOperations && i < json_array_size(operatorsJ); ++i)
+    {
+        json_t* operatorJ = json_array_get(operatorsJ, i);
+        json_t* typeJ = json_object_get(operatorJ, "type");
+        json_t* kJ = json_object_get(operatorJ, "k");
+        json_t* truthTableJ = json_object_get(operatorJ, "truthTable");
+        json_t* operationInputsJ = json_object_get(operatorJ, "operationInputs");
+
+        LogicOperation::OperatorDefinition definition;
+        int type = typeJ ? json_integer_value(typeJ) : 0;
+        if (0 <= type && type < static_cast<int>(LogicOperation::OperatorDefinition::Type::NumTypes))
+        {
+            definition.m_type = static_cast<LogicOperation::OperatorDefinition::Type>(type);
+        }
+
+        long long k = kJ ? json_integer_value(kJ) : 1;
+        definition.m_k = static_cast<uint8_t>(std::max<long long>(0, std::min<long long>(k, x_maxOperatorK)));
+        definition.m_truthTable = json_is_string(truthTableJ) ? strtoull(json_string_value(truthTableJ), nullptr, 16) : 0;
+        m_operations[i].SetDefinition(definition);
+        m_operations[i].SetOperationInputs(operationInputsJ ? json_integer_value(operationInputsJ) & ((1 << x_numOperations) - 1) : 0);
+    }
 }
@@ -3,29 +3,89 @@
 #include <cstddef>
 #include "LogicMatrixConstants.hpp"
 #include "LatticeExpander.hpp"
+#include "Trace.hpp"
+#include "Recording.hpp"
+#include "Latency.hpp"
+#include "BitKernels.hpp"
+#include "Snapshot.hpp"
+
+// Sent from a LogicMatrix to a LogicMatrix directly on its right, so a chain of them can share
+// gates without cables.  Each module still evaluates on its own (and so on its own engine thread);
+// like any expander message it arrives one sample later.
+//
+struct ChainMessage
+{
+    bool m_valid;
+    uint8_t m_inputVector;
+    uint8_t m_operationBits;
+
+    ChainMessage()
+    {
+        memset(this, 0, sizeof(ChainMessage));
+    }
+};
+
+// Where each InputVector lands on the lattice.  That only changes with the params, so a
+// LogicMatrix keeps two of these and a VoiceExpander on its right is sent a pointer rather than
+// a copy.  The expander reads the table named in last sample's message while this sample's is
+// filled in, and the params move at most once a sample, so two are enough.
+//
+struct VoicePositions
+{
+    uint8_t m_high[1 << LogicMatrixConstants::x_numInputs][LogicMatrixConstants::x_numAccumulators];
+
+    VoicePositions()
+    {
+        memset(this, 0, sizeof(VoicePositions));
+    }
+};
+
+// Sent from a LogicMatrix to a VoiceExpander directly on its right.  The intervals, the
+// accumulators interval CV moves and distinct pitches are what collapsing duplicate pitches
+// needs.
+//
+struct VoiceExpanderMessage
+{
+    const VoicePositions* m_positions;
+    float m_intervalPitches[LogicMatrixConstants::x_numAccumulators];
+    uint32_t m_paramsGeneration;
+    uint8_t m_inputVector;
+    uint8_t m_intervals[LogicMatrixConstants::x_numAccumulators];
+    uint8_t m_offsetIntervalCVs;
+    bool m_distinctPitches;
+
+    VoiceExpanderMessage()
+    {
+        memset(this, 0, sizeof(VoiceExpanderMessage));
+    }
+};
 
 struct LogicMatrix : Module
 {
-    LatticeExpanderMessage m_rightMessages[2][1];
+    LatticeMaskMessage m_rightMessages[2][1];
+    ChainMessage m_leftMessages[2][1];
+
+    // What unpatched gate inputs follow when there is a LogicMatrix on the left.
+    // A patched cable always wins.
+    //
+    enum class ChainMode : int
+    {
+        Off = 0,
+        LeftInputs = 1,
+        LeftOperations = 2,
+        NumModes = 3
+    };
     
-    struct Input
+    // How a voice picks from its candidates.  Percentile follows the knob and CV; the random
+    // modes draw a new candidate each time the InputVector changes, either giving every
+    // lattice point the same chance or weighting each by how many candidates land on it.
+    //
+    enum class Selection : int
     {
-        rack::engine::Input* m_port = nullptr;
-        rack::dsp::TSchmittTrigger<float> m_schmittTrigger;
-        rack::engine::Light* m_light = nullptr;
-        bool m_value = false;
-        uint8_t m_counter = 0;
-
-        void Init(
-            rack::engine::Input* port,
-            rack::engine::Light* light)
-        {
-            m_port = port;
-            m_light = light;
-            m_counter = 0;
-        }
-        
-        void SetValue(Input* prev);
+        Percentile = 0,
+        Random = 1,
+        RandomWeighted = 2,
+        NumSelections = 3
     };
 
     struct MatrixElement
@@ -36,15 +96,6 @@ struct LogicMatrix : Module
             Muted = 1,
             Normal = 2
         };
-        
-        void Init(rack::engine::Param* swtch)
-        {
-            m_switch = swtch;
-        }
-        
-        SwitchVal GetSwitchVal();
-        
-        rack::engine::Param* m_switch = nullptr;
     };
 
     struct InputVector
@@ -76,10 +127,58 @@ struct LogicMatrix : Module
             }
         }
 
-        size_t CountSetBits();
+        size_t CountSetBits()
+        {
+            return BitKernels::g_countSetBits(m_bits);
+        }
 
         uint8_t m_bits;
     };
+
+    // All six gate inputs go through two float_4 Schmitt triggers at once, and the
+    // InputVector is read straight off the trigger state with movemask.
+    //
+    struct InputStage
+    {
+        static constexpr size_t x_numLanes = 8;
+        
+        rack::engine::Input* m_ports[LogicMatrixConstants::x_numInputs] = {};
+        rack::engine::Light* m_lights[LogicMatrixConstants::x_numInputs] = {};
+        rack::dsp::TSchmittTrigger<rack::simd::float_4> m_schmittTriggers[x_numLanes / 4];
+        uint8_t m_counters[LogicMatrixConstants::x_numInputs] = {};
+        InputVector m_values;
+        InputVector m_connected;
+        InputVector m_lightLatch;
+
+        // The triggers' states last sample, and the last frame a patched input crossed its
+        // threshold (-1 if none has), which latency measurement takes as the edge.
+        //
+        uint32_t m_triggerStates = 0;
+        int64_t m_lastCrossing = -1;
+
+        void Init(
+            size_t inputId,
+            rack::engine::Input* port,
+            rack::engine::Light* light)
+        {
+            m_ports[inputId] = port;
+            m_lights[inputId] = light;
+            m_counters[inputId] = 0;
+        }
+
+        InputVector Process(int64_t frame);
+
+        void SetLights()
+        {
+            using namespace LogicMatrixConstants;
+            for (size_t i = 0; i < x_numInputs; ++i)
+            {
+                m_lights[i]->setBrightness(m_lightLatch.Get(i) ? 1.f : 0.f);
+            }
+
+            m_lightLatch = InputVector();
+        }
+    };
     
     struct LogicOperation
     {
@@ -99,56 +198,148 @@ struct LogicMatrix : Module
             Up = 2
         };
 
-        Operator GetOperator();
-        SwitchVal GetSwitchVal();
-        
-        void SetBitVectors()
+        // Set from the context menu to override the operator knob.
+        //
+        struct OperatorDefinition
         {
-            using namespace LogicMatrixConstants;
-            for (size_t i = 0; i < x_numInputs; ++i)
+            enum class Type : char
+            {
+                Knob = 0,
+                AtLeast = 1,
+                Exactly = 2,
+                Nand = 3,
+                Nor = 4,
+                TruthTable = 5,
+                NumTypes = 6
+            };
+
+            Type m_type = Type::Knob;
+            uint8_t m_k = 1;
+
+            // Bit i is the output for masked input vector i.
+            //
+            uint64_t m_truthTable = 0;
+
+            bool GetValue(Operator knobOperator, uint8_t maskedVector, size_t countHigh, size_t countTotal) const;
+            std::string GetName() const;
+
+            bool operator==(const OperatorDefinition& other) const
+            {
+                return m_type == other.m_type && m_k == other.m_k && m_truthTable == other.m_truthTable;
+            }
+
+            bool operator!=(const OperatorDefinition& other) const
             {
-                MatrixElement::SwitchVal switchVal = m_elements[i].GetSwitchVal();
-                m_active.Set(i, switchVal != MatrixElement::SwitchVal::Muted);
-                m_inverted.Set(i, switchVal == MatrixElement::SwitchVal::Inverted);
+                return !(*this == other);
             }
+        };
+
+        // Recompiles m_truthTables if the operator, the definition, the number of active inputs
+        // or the number of operation inputs changed, and returns them.  The definition is the
+        // one the params watcher latched.
+        //
+        const uint64_t* Update(
+            const OperatorDefinition& definition,
+            Operator knobOperator,
+            size_t countTotal,
+            size_t numOperationInputs)
+        {
+            if (!m_compiled ||
+                knobOperator != m_compiledOperator ||
+                countTotal != m_compiledCountTotal ||
+                numOperationInputs != m_compiledNumOperationInputs ||
+                definition != m_compiledDefinition)
+            {
+                Compile(definition, knobOperator, countTotal, numOperationInputs);
+                m_compiled = true;
+                m_compiledOperator = knobOperator;
+                m_compiledCountTotal = countTotal;
+                m_compiledNumOperationInputs = numOperationInputs;
+                m_compiledDefinition = definition;
+            }
+
+            return m_truthTables;
         }
-        
+
+        void Compile(const OperatorDefinition& definition, Operator knobOperator, size_t countTotal, size_t numOperationInputs);
+
+        // Called from the UI thread, which is the only writer.
+        //
+        void SetDefinition(OperatorDefinition definition)
+        {
+            m_definition.BeginWrite() = definition;
+            m_definition.EndWrite();
+        }
+
+        // Called from the UI thread.  Being the writer, it can read the value without the seqlock.
+        //
+        OperatorDefinition GetDefinition()
+        {
+            return m_definition.m_value;
+        }
+
+        // Called from the UI thread, which keeps the network free of cycles.
+        //
+        void SetOperationInputs(uint8_t operationInputs)
+        {
+            m_operationInputs.store(operationInputs, std::memory_order_relaxed);
+        }
+
+        uint8_t GetOperationInputs()
+        {
+            return m_operationInputs.load(std::memory_order_relaxed);
+        }
+
         void Init(
-            rack::engine::Param* swtch,
-            rack::engine::Param* operatorKnob,
             rack::engine::Output* output,
             rack::engine::Light* light)
         {
-            m_switch = swtch;
-            m_operatorKnob = operatorKnob;
             m_output = output;
             m_light = light;
         }            
 
-        bool GetValue(InputVector inputVector);
-
+        // An unpatched output isn't driven, but the light and the chain still see the value.
+        //
         void SetOutput(bool value)
         {
-            m_output->setVoltage(value ? 5.f : 0.f);
-            m_light->setBrightness(value ? 1.f : 0.f);
+            if (m_output->isConnected())
+            {
+                m_output->setVoltage(value ? 5.f : 0.f);
+            }
+
+            m_lightLatch |= value;
         }
 
-        // Up is output zero but input id 2, so invert.
-        //
-        size_t GetOutputTarget()
+        void SetLight()
         {
-            using namespace LogicMatrixConstants;
-            return x_numAccumulators - static_cast<size_t>(GetSwitchVal()) - 1;
+            m_light->setBrightness(m_lightLatch ? 1.f : 0.f);
+            m_lightLatch = false;
         }
 
-        rack::engine::Param* m_switch = nullptr;
-        rack::engine::Param* m_operatorKnob = nullptr;
         rack::engine::Light* m_light = nullptr;
         rack::engine::Output* m_output = nullptr;
-        InputVector m_active;
-        InputVector m_inverted;
+        bool m_lightLatch = false;
+
+        // Published by the UI and latched by the audio thread through the params watcher, so
+        // Compile never sees a definition half written.
+        //
+        Snapshot<OperatorDefinition> m_definition;
+
+        // The second layer: bit i is set if operation i's output is one more input to this one.
+        // Operation inputs add to the count the counting operators see, and never go through
+        // the matrix switches.  A truth table only sees the gate inputs.
+        //
+        std::atomic<uint8_t> m_operationInputs{0};
 
-        LogicMatrix::MatrixElement m_elements[LogicMatrixConstants::x_numInputs];
+        // Every operator compiles to these, one per number of high operation inputs, so the
+        // network can be compiled without looking at the operator again.
+        //
+        uint64_t m_truthTables[LogicMatrixConstants::x_numOperations] = {};
+        bool m_compiled = false;
+        Operator m_compiledOperator = Operator::Or;
+        size_t m_compiledCountTotal = 0;
+        size_t m_compiledNumOperationInputs = 0;
+        OperatorDefinition m_compiledDefinition;
     };
 
     struct Accumulator
@@ -166,16 +357,20 @@ struct LogicMatrix : Module
             Octave = 8
         };
 
-        static constexpr float x_voltages[] = {
-            0 /*Off*/,
-            0.09310940439 /*half step = log_2(16/15)*/,
-            0.16992500144231237/*whole tone = log_2(9/8)*/,
-            0.2630344058337938 /*minor third = log_2(6/5)*/,
-            0.32192809488736235 /*major third = log_2(5/4)*/,
-            0.4150374992788437 /*perfect fourth = log_2(4/3)*/,
-            0.5849625007211562 /*pefect fifth = log_2(3/2)*/,
-            0.8073549220576041 /*minor seventh = log_2(7/4)*/,
-            1.0 /*octave = log_2(2)*/
+        // The ratios behind x_intervalVoltages as exponents of 2, 3, 5 and 7, so candidates can
+        // be told apart by their exact ratio rather than by a float sum.
+        //
+        static constexpr size_t x_numPrimes = 4;
+        static constexpr int8_t x_primeExponents[][x_numPrimes] = {
+            {0, 0, 0, 0} /*Off*/,
+            {4, -1, -1, 0} /*half step = 16/15*/,
+            {-3, 2, 0, 0} /*whole tone = 9/8*/,
+            {1, 1, -1, 0} /*minor third = 6/5*/,
+            {-2, 0, 1, 0} /*major third = 5/4*/,
+            {2, -1, 0, 0} /*perfect fourth = 4/3*/,
+            {-1, 1, 0, 0} /*perfect fifth = 3/2*/,
+            {-2, 0, 0, 1} /*minor seventh = 7/4*/,
+            {1, 0, 0, 0} /*octave = 2*/
         };
 
         // Fake semitones map for the expander.
@@ -191,26 +386,6 @@ struct LogicMatrix : Module
             10 /*minor seventh*/,
             0 /*octave*/
         };
-        
-        rack::engine::Param* m_intervalKnob = nullptr;
-        rack::engine::Input* m_intervalCV = nullptr;
-
-        Interval GetInterval();
-
-        int GetSemitones()
-        {
-            return x_semitones[static_cast<int>(GetInterval())];
-        }
-
-        float GetPitch();
-
-        void Init(
-            rack::engine::Param* intervalKnob,
-            rack::engine::Input* intervalCV)
-        {
-            m_intervalKnob = intervalKnob;
-            m_intervalCV = intervalCV;
-        }
     };
 
     struct MatrixEvalResult
@@ -226,14 +401,14 @@ struct LogicMatrix : Module
             }
         }
 
-        void SetPitch(Accumulator* accumulators)
+        void SetPitch(const float* intervalPitches)
         {
             using namespace LogicMatrixConstants;
             
             float result = 0;
             for (size_t i = 0; i < x_numAccumulators; ++i)
             {
-                result += accumulators[i].GetPitch() * m_high[i];
+                result += intervalPitches[i] * m_high[i];
             }
 
             m_pitch = result;
@@ -249,72 +424,119 @@ struct LogicMatrix : Module
         float m_pitch;
     };
 
-    MatrixEvalResult EvalMatrix(InputVector inputVector);
-
-    struct InputVectorIterator
+    void EvalMatrix(const uint8_t* inputVectors, size_t numInputVectors, MatrixEvalResult* results);
+    
+    // Everything evaluation reads, packed together instead of being reached through a Param*
+    // per switch.  The parts that come from params are rebuilt only when the params generation
+    // moves, and the CV parts just before evaluating.  Pointers and the rarely used state stay
+    // in LogicOperation and Output.
+    //
+    struct HotState
     {
-        uint8_t m_ordinal = 0;
-        InputVector m_coMuteVector;
-        size_t m_coMuteSize = 0;
-        InputVector m_defaultVector;
-        size_t m_forwardingIndices[LogicMatrixConstants::x_numInputs];
-
-        InputVectorIterator(InputVector coMuteVector, InputVector defaultVector);
+        // Bit v is operation i's output for InputVector v, with the matrix switches and any
+        // operation inputs already folded in.
+        //
+        uint64_t m_outputWords[LogicMatrixConstants::x_numOperations];
+        uint8_t m_outputTargets[LogicMatrixConstants::x_numOperations];
+        uint8_t m_coMuteVectors[LogicMatrixConstants::x_numAccumulators];
+        uint8_t m_intervals[LogicMatrixConstants::x_numAccumulators];
+        float m_intervalPitches[LogicMatrixConstants::x_numAccumulators];
+
+        // Per voice, which candidate InputVectors the scale mask lets through.  All ones when
+        // the voice is not masked.
+        //
+        uint64_t m_allowedVectors[LogicMatrixConstants::x_numAccumulators];
+        float m_percentiles[LogicMatrixConstants::x_numAccumulators];
+        uint32_t m_paramsGeneration;
 
-        InputVector Get();
-        void Next();
-        bool Done();
-    };
-    
-    struct CoMuteSwitch
-    {        
-        void Init(rack::engine::Param* swtch)
+        HotState()
         {
-            m_switch = swtch;
+            memset(this, 0, sizeof(HotState));
         }
-        
-        bool IsCoMuted()
+
+        bool GetValue(size_t operationId, uint8_t inputVector) const
         {
-            return m_switch->getValue() < 0.5;
+            return (m_outputWords[operationId] >> inputVector) & 1;
         }
-        
-        rack::engine::Param* m_switch = nullptr;
     };
 
-    struct CoMuteState
+    static_assert(sizeof(HotState) <= 128, "LogicMatrix::HotState should fit in two cache lines");
+
+    void UpdateHotState();
+    void CompileNetwork(const uint8_t* active, const uint8_t* inverted);
+    void UpdateHotCVs();
+
+    // Whether operationId takes otherId's output, directly or through other operations.
+    // UI thread, for refusing connections that would close a loop.
+    //
+    bool OperationDependsOn(size_t operationId, size_t otherId)
     {
-        InputVector GetCoMuteVector()
+        uint8_t reached = 0;
+        uint8_t frontier = m_operations[operationId].GetOperationInputs();
+        while (frontier & ~reached)
         {
-            using namespace LogicMatrixConstants;
-            
-            InputVector result;
-            for (size_t i = 0; i < x_numInputs; ++i)
+            reached |= frontier;
+            uint8_t next = 0;
+            for (size_t i = 0; i < LogicMatrixConstants::x_numOperations; ++i)
             {
-                result.Set(i, m_switches[i].IsCoMuted());
+                if ((frontier >> i) & 1)
+                {
+                    next |= m_operations[i].GetOperationInputs();
+                }
             }
 
-            return result;
+            frontier = next;
         }
 
-        void Init(
-            rack::engine::Param* percentileKnob,
-            rack::engine::Input* percentileCV)
+        return (reached >> otherId) & 1;
+    }
+
+    // Polyphonic interval CV.  Channel 0 is what HotState has, and it alone decides which
+    // candidate each voice lands on, so the discrete evaluation runs once whatever the channel
+    // count.  Each channel then only redoes the final dot product with its own intervals,
+    // four channels at a time.
+    //
+    struct PolyPitchStage
+    {
+        rack::simd::float_4 m_intervalPitches[LogicMatrixConstants::x_numAccumulators][PORT_MAX_CHANNELS / 4];
+        int m_channels = 1;
+
+        void GetPitches(const uint8_t* high, rack::simd::float_4* pitches) const
         {
-            m_percentileKnob = percentileKnob;
-            m_percentileCV = percentileCV;
+            using namespace LogicMatrixConstants;
+
+            for (int c = 0; c < m_channels; c += 4)
+            {
+                rack::simd::float_4 pitch = 0.f;
+                for (size_t i = 0; i < x_numAccumulators; ++i)
+                {
+                    pitch += m_intervalPitches[i][c / 4] * static_cast<float>(high[i]);
+                }
+
+                pitches[c / 4] = pitch;
+            }
         }
+    };
+
+    void UpdatePolyPitch();
+
+    // The sorted candidate pitches of each voice, for the histogram on the panel.
+    //
+    struct CandidateDistribution
+    {
+        struct Voice
+        {
+            float m_pitches[1 << LogicMatrixConstants::x_numInputs];
+            uint8_t m_numCandidates;
+            uint8_t m_selected;
+        };
+
+        Voice m_voices[LogicMatrixConstants::x_numAccumulators];
 
-        float GetPercentile()
+        CandidateDistribution()
         {
-            float result = m_percentileKnob->getValue() + m_percentileCV->getVoltage() / 5.0;
-            result = std::min(result, 1.f);
-            result = std::max(result, 0.f);
-            return result;
+            memset(this, 0, sizeof(CandidateDistribution));
         }
-        
-        CoMuteSwitch m_switches[LogicMatrixConstants::x_numInputs];
-        rack::engine::Param* m_percentileKnob = nullptr;
-        rack::engine::Input* m_percentileCV = nullptr;
     };
 
     struct Output
@@ -323,11 +545,37 @@ struct LogicMatrix : Module
         rack::engine::Output* m_triggerOut = nullptr;
         rack::engine::Light* m_triggerLight = nullptr;
         rack::dsp::PulseGenerator m_pulseGen;
+        bool m_triggerLatch = false;
+        bool m_triggerHigh = false;
         float m_pitch = 0.0;
-        CoMuteState m_coMuteState;
 
-        MatrixEvalResult ComputePitch(LogicMatrix* matrix, InputVector defaultVector);
-       
+        // Running counts of pitch changes and trigger rising edges, for latency measurement.
+        //
+        uint32_t m_numPitchChanges = 0;
+        uint32_t m_numTriggers = 0;
+
+        // False while nothing listens to this voice and it isn't being evaluated.
+        //
+        bool m_active = true;
+        int m_channels = 1;
+
+        bool IsConnected()
+        {
+            return m_mainOut->isConnected() || m_triggerOut->isConnected();
+        }
+
+        // Picks up the current pitch after the voice has been idle, without firing a trigger
+        // for a change that happened while nobody was listening.
+        //
+        void Resync(float pitch)
+        {
+            m_pitch = pitch;
+            m_mainOut->setVoltage(pitch);
+            m_pulseGen.reset();
+            m_triggerOut->setVoltage(0.f);
+            m_triggerHigh = false;
+        }
+
         void SetPitch(float pitch, float dt)
         {
             bool changedThisFrame = (pitch != m_pitch);
@@ -337,48 +585,319 @@ struct LogicMatrix : Module
             if (changedThisFrame)
             {
                 m_pulseGen.trigger(0.01);
+                ++m_numPitchChanges;
             }
 
             bool trig = m_pulseGen.process(dt);
             m_triggerOut->setVoltage(trig ? 5.f : 0.f);
-            m_triggerLight->setBrightness(trig ? 1.f : 0.f);
+            m_triggerLatch |= trig;
+            m_numTriggers += trig && !m_triggerHigh;
+            m_triggerHigh = trig;
+        }
+
+        // For polyphonic interval CV, after SetPitch or Resync.  The trigger only follows
+        // channel 0, which is rewritten last so it stays exactly m_pitch.
+        //
+        void SetChannelPitches(const rack::simd::float_4* pitches, int channels)
+        {
+            if (channels != m_channels)
+            {
+                m_mainOut->setChannels(channels);
+                m_channels = channels;
+            }
+
+            for (int c = 0; c < channels; c += 4)
+            {
+                m_mainOut->setVoltageSimd(pitches[c / 4], c);
+            }
+
+            m_mainOut->setVoltage(m_pitch);
         }
 
-        InputVectorIterator GetInputVectorIterator(InputVector defaultVector)
+        // Any trigger since the last light update lights the LED, and it fades out smoothly,
+        // so pulses shorter than the light division are still visible.
+        //
+        void SetLight(float lightDt)
         {
-            return InputVectorIterator(m_coMuteState.GetCoMuteVector(), defaultVector);
+            m_triggerLight->setBrightnessSmooth(m_triggerLatch ? 1.f : 0.f, lightDt);
+            m_triggerLatch = false;
         }
-        
+
         void Init(
             rack::engine::Output* mainOut,
             rack::engine::Output* triggerOut,
-            rack::engine::Light* triggerLight,
-            rack::engine::Param* percentileKnob,
-            rack::engine::Input* percentileCV)
+            rack::engine::Light* triggerLight)
         {
             m_mainOut = mainOut;
             m_triggerOut = triggerOut;
             m_triggerLight = triggerLight;
-            m_coMuteState.Init(percentileKnob, percentileCV);
         }
     };
 
-    InputVector ProcessInputs();
-    void ProcessOperations(InputVector defaultVector);
-    void ProcessOutputs(InputVector defaultVector, float dt);
+    // Vose's alias method over a voice's candidate InputVectors, so a draw costs one random
+    // number however many candidates there are.  Rebuilt only when the candidate set changes.
+    //
+    struct AliasTable
+    {
+        uint8_t m_candidates[1 << LogicMatrixConstants::x_numInputs];
+        uint8_t m_aliases[1 << LogicMatrixConstants::x_numInputs];
+        float m_probabilities[1 << LogicMatrixConstants::x_numInputs];
+        size_t m_size = 0;
+
+        // What the table was built for.
+        //
+        bool m_valid = false;
+        uint8_t m_key = 0;
+        uint8_t m_offsetIntervalCVs = 0;
+        uint32_t m_paramsGeneration = 0;
+        Selection m_selection = Selection::Percentile;
+
+        // The candidate drawn for the current InputVector.
+        //
+        uint8_t m_drawn = 0;
+
+        void Build(const uint8_t* candidates, const float* weights, size_t size);
+
+        uint8_t Draw(rack::random::Xoroshiro128Plus& rng)
+        {
+            uint64_t r = rng();
+            size_t ix = ((r >> 32) * m_size) >> 32;
+            float coin = static_cast<uint32_t>(r) * (1.f / 4294967296.f);
+            return coin < m_probabilities[ix] ? m_candidates[ix] : m_candidates[m_aliases[ix]];
+        }
+    };
+
+    // For collapsing candidates with the same pitch.  There are at most 64 candidates, so with
+    // twice as many slots linear probing always finds a free one quickly.
+    //
+    struct PitchKeySet
+    {
+        static constexpr size_t x_numSlots = 2 << LogicMatrixConstants::x_numInputs;
+
+        uint64_t m_keys[x_numSlots];
+        uint8_t m_counts[x_numSlots] = {};
+
+        // Returns the slot holding key, after counting it.
+        //
+        size_t Insert(uint64_t key)
+        {
+            size_t slot = (key * 0x9e3779b97f4a7c15ull) >> (64 - LogicMatrixConstants::x_numInputs - 1);
+            while (m_counts[slot] && m_keys[slot] != key)
+            {
+                slot = (slot + 1) % x_numSlots;
+            }
+
+            m_keys[slot] = key;
+            ++m_counts[slot];
+            return slot;
+        }
+    };
+
+    uint8_t GetOffsetIntervalCVs();
+    static uint64_t GetPitchKey(const MatrixEvalResult& result, const uint8_t* intervals, uint8_t offsetIntervalCVs);
+    static size_t CollapseDuplicatePitches(MatrixEvalResult* results, size_t numResults, const uint8_t* intervals, uint8_t offsetIntervalCVs);
+    size_t GetCandidates(size_t outputId, InputVector defaultVector, uint8_t* candidates);
+
+    MatrixEvalResult ComputePitch(
+        size_t outputId,
+        InputVector defaultVector,
+        CandidateDistribution::Voice* distribution = nullptr);
+
+    MatrixEvalResult ComputeRandomPitch(size_t outputId, InputVector defaultVector, bool newStep);
+    void MarkDrawnPitch(size_t outputId, InputVector defaultVector, float pitch, CandidateDistribution::Voice* distribution);
+
+    // Restarts the random sequence from m_seed.  Audio thread only; the UI asks for it
+    // through m_reseedRequested.  A recording in progress notes the new generator state.
+    //
+    void ResetRandom()
+    {
+        uint32_t seed = m_seed.load(std::memory_order_relaxed);
+        m_rng.seed(seed, seed ^ 0x9e3779b97f4a7c15ull);
+        m_lastStepVector = -1;
+        m_recorder.m_needsRandom = true;
+    }
+
+    // With no CV patched, what each voice does is a function of the InputVector and the params
+    // alone.  That is always the case for the divide-by-two normalled inputs, where the vector
+    // runs through a fixed 64 step period.  So results are kept per InputVector and reused
+    // until a param or operator definition changes, and most samples are just a table lookup.
+    //
+    struct SequenceTable
+    {
+        // Per voice, since idle voices are skipped.
+        //
+        uint64_t m_valid[LogicMatrixConstants::x_numAccumulators] = {};
+        uint32_t m_paramsGeneration = 0;
+        MatrixEvalResult m_results[1 << LogicMatrixConstants::x_numInputs][LogicMatrixConstants::x_numAccumulators];
+
+        bool IsValid(InputVector inputVector, size_t outputId)
+        {
+            return (m_valid[outputId] >> inputVector.m_bits) & 1;
+        }
+
+        void SetValid(InputVector inputVector, size_t outputId)
+        {
+            m_valid[outputId] |= uint64_t(1) << inputVector.m_bits;
+        }
+
+        void Invalidate()
+        {
+            memset(m_valid, 0, sizeof(m_valid));
+        }
+    };
+
+    // Everything evaluation reads that isn't a param: the operator definitions and operation
+    // inputs set from the context menu, the scale masks from a LatticeExpander, distinct
+    // pitches and how each voice picks its candidate.
+    //
+    struct ModuleState
+    {
+        LogicOperation::OperatorDefinition m_definitions[LogicMatrixConstants::x_numOperations];
+        uint8_t m_operationInputs[LogicMatrixConstants::x_numOperations] = {};
+        uint64_t m_cellMasks[LogicMatrixConstants::x_numAccumulators] = {};
+        bool m_distinctPitches = false;
+        Selection m_selections[LogicMatrixConstants::x_numAccumulators] = {};
+
+        bool operator==(const ModuleState& other) const
+        {
+            using namespace LogicMatrixConstants;
+
+            for (size_t i = 0; i < x_numOperations; ++i)
+            {
+                if (m_definitions[i] != other.m_definitions[i] ||
+                    m_operationInputs[i] != other.m_operationInputs[i])
+                {
+                    return false;
+                }
+            }
+
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                if (m_cellMasks[i] != other.m_cellMasks[i] ||
+                    m_selections[i] != other.m_selections[i])
+                {
+                    return false;
+                }
+            }
+
+            return m_distinctPitches == other.m_distinctPitches;
+        }
+
+        bool operator!=(const ModuleState& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    // Bumped whenever a param or the module state changes.  Evaluation only reads the params
+    // and module state latched here, which is also what a recording holds, so replay sees
+    // exactly what was recorded.  While replaying, the module state is the recording's.
+    //
+    struct ParamsWatcher
+    {
+        uint32_t m_generation = 1;
+        float m_params[LogicMatrixConstants::GetNumParams()] = {};
+        ModuleState m_state;
+
+        // The operator definitions last read from the UI, and the generations they were
+        // published under.
+        //
+        LogicOperation::OperatorDefinition m_uiDefinitions[LogicMatrixConstants::x_numOperations];
+        uint32_t m_definitionGenerations[LogicMatrixConstants::x_numOperations] = {};
+    };
+
+    // The reverse of the sequence table: for each voice and lattice position, the InputVectors
+    // that land there.  Rebuilt one InputVector per sample after a params change, or one per
+    // light tick continuously while pitch CV is patched, and only while a LatticeExpander is
+    // attached, then copied to the expander in one go.
+    //
+    struct LatticeIndexBuilder
+    {
+        LatticeIndex m_index;
+        uint32_t m_paramsGeneration = 0;
+        size_t m_next = 0;
+        int64_t m_sentTo = -1;
+        bool m_builtWithCVs = false;
+
+        void Restart(uint32_t paramsGeneration, bool withCVs)
+        {
+            m_index.Clear();
+            m_paramsGeneration = paramsGeneration;
+            m_next = 0;
+            m_sentTo = -1;
+            m_builtWithCVs = withCVs;
+        }
+    };
+
+    bool CanUseSequenceTable();
+    void UpdateParamsGeneration();
+    void CheckParams();
+
+    InputVector ProcessInputs(int64_t frame);
+    InputVector ApplyChain(InputVector inputVector);
+    uint8_t ProcessOperations(InputVector defaultVector);
+    uint8_t GetListenedVoices();
+    void ProcessOutputs(InputVector defaultVector, uint8_t listened, bool lightTick, float dt);
+    void MeasureEdges(int64_t frame, InputVector defaultVector);
+    void MeasureLatency(int64_t frame, uint8_t operationBits);
+    void ProcessLights(float dt);
+    void ProcessLatticeIndex(bool lightTick);
+
+    void RecordSample(InputVector inputVector, uint8_t listened, float sampleRate);
+    bool ReplaySample(InputVector* inputVector, float* sampleTime);
+
+    void SendChainMessage(InputVector inputVector, uint8_t operationBits)
+    {
+        if (rightExpander.module && rightExpander.module->model == modelLogicMatrix)
+        {
+            ChainMessage* msg = static_cast<ChainMessage*>(rightExpander.module->leftExpander.producerMessage);
+            msg->m_valid = true;
+            msg->m_inputVector = inputVector.m_bits;
+            msg->m_operationBits = operationBits;
+            rightExpander.module->leftExpander.messageFlipRequested = true;
+        }
+    }
 
-    void SendExpanderMessage(LatticeExpanderMessage msg)
+    void SendVoiceExpanderMessage(InputVector inputVector)
+    {
+        using namespace LogicMatrixConstants;
+
+        if (rightExpander.module && rightExpander.module->model == modelVoiceExpander)
+        {
+            // The main voices only bring the CVs in the hot state up to date when they evaluate.
+            //
+            UpdateHotCVs();
+
+            VoiceExpanderMessage* msg = static_cast<VoiceExpanderMessage*>(rightExpander.module->leftExpander.producerMessage);
+            msg->m_positions = &m_voicePositions[m_voicePositionsIndex];
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                msg->m_intervalPitches[i] = m_hot.m_intervalPitches[i];
+                msg->m_intervals[i] = m_hot.m_intervals[i];
+            }
+
+            msg->m_paramsGeneration = m_hot.m_paramsGeneration;
+            msg->m_inputVector = inputVector.m_bits;
+            msg->m_offsetIntervalCVs = GetOffsetIntervalCVs();
+            msg->m_distinctPitches = m_paramsWatcher.m_state.m_distinctPitches;
+            rightExpander.module->leftExpander.messageFlipRequested = true;
+        }
+    }
+
+    void SendExpanderMessage(LatticeExpanderMessage* msg)
     {
         using namespace LogicMatrixConstants;           
 
         for (size_t i = 0; i < x_numAccumulators; ++i)
         {
-            msg.m_intervalSemitones[i] = m_accumulators[i].GetSemitones();
+            msg->m_intervalSemitones[i] = Accumulator::x_semitones[m_hot.m_intervals[i]];
         }
+
+        msg->m_lightDivision = m_lightDivider.getDivision();
         
         if (rightExpander.module && rightExpander.module->model == modelLatticeExpander)
         {
-            *static_cast<LatticeExpanderMessage*>(rightExpander.module->leftExpander.producerMessage) = msg;
+            *static_cast<LatticeExpanderMessage*>(rightExpander.module->leftExpander.producerMessage) = *msg;
             rightExpander.module->leftExpander.messageFlipRequested = true;
         }
     }
@@ -391,8 +910,100 @@ struct LogicMatrix : Module
 
     void process(const ProcessArgs& args) override;
 
-    Input m_inputs[LogicMatrixConstants::x_numInputs];
+    json_t* dataToJson() override;
+    void dataFromJson(json_t* rootJ) override;
+
+    // Called from the UI.  The audio thread picks the new division up at the start of its next
+    // sample, so only it ever touches m_lightDivider.
+    //
+    void SetLightDivisionIndex(size_t index)
+    {
+        using namespace LogicMatrixConstants;
+        m_lightDivisionIndex.store(std::min(index, x_numLightDivisions - 1), std::memory_order_relaxed);
+    }
+
+    void ApplyLightDivision()
+    {
+        using namespace LogicMatrixConstants;
+        size_t index = m_lightDivisionIndex.load(std::memory_order_relaxed);
+        if (index != m_appliedLightDivisionIndex)
+        {
+            m_appliedLightDivisionIndex = index;
+            m_lightDivider.setDivision(x_lightDivisions[index]);
+        }
+    }
+
+    // Set from the UI, and read by the audio thread every sample.
+    //
+    ChainMode GetChainMode()
+    {
+        return static_cast<ChainMode>(m_chainMode.load(std::memory_order_relaxed));
+    }
+
+    void SetChainMode(ChainMode chainMode)
+    {
+        m_chainMode.store(static_cast<int>(chainMode), std::memory_order_relaxed);
+    }
+
+    std::atomic<int> m_chainMode{static_cast<int>(ChainMode::Off)};
+
+    // Set from the UI.  Evaluation reads the selections the params watcher latched.
+    //
+    Selection GetSelection(size_t outputId)
+    {
+        return static_cast<Selection>(m_selections[outputId].load(std::memory_order_relaxed));
+    }
+
+    void SetSelection(size_t outputId, Selection selection)
+    {
+        m_selections[outputId].store(static_cast<int>(selection), std::memory_order_relaxed);
+    }
+
+    std::atomic<int> m_selections[LogicMatrixConstants::x_numAccumulators];
+
+    // Candidates that reach the same pitch by different routes count once, for the percentile
+    // and for the chance of each pitch in Random mode.  Set from the UI.
+    //
+    std::atomic<bool> m_distinctPitches{false};
+
+    // Saved with the patch, and the random sequence restarts from it on load, so renders are
+    // reproducible.  Recordings hold the generator's state, so replay draws what recording did.
+    //
+    std::atomic<uint32_t> m_seed{0};
+    std::atomic<bool> m_reseedRequested{true};
+    rack::random::Xoroshiro128Plus m_rng;
+    int m_lastStepVector = -1;
+    AliasTable m_aliasTables[LogicMatrixConstants::x_numAccumulators];
+    std::atomic<size_t> m_lightDivisionIndex{LogicMatrixConstants::x_defaultLightDivisionIndex};
+    size_t m_appliedLightDivisionIndex = LogicMatrixConstants::x_numLightDivisions;
+    rack::dsp::ClockDivider m_lightDivider;
+
+    Trace::Tracer m_tracer;
+    Latency::Meter m_latency;
+    Recording::Recorder m_recorder;
+    Recording::Player m_player;
+    float m_replaySampleTime = 0;
+    ModuleState m_replayState;
+    uint8_t m_replayListened = 0;
+
+    HotState m_hot;
+    PolyPitchStage m_polyPitch;
+    InputStage m_inputStage;
     LogicOperation m_operations[LogicMatrixConstants::x_numOperations];
-    Accumulator m_accumulators[LogicMatrixConstants::x_numAccumulators];
     Output m_outputs[LogicMatrixConstants::x_numAccumulators];
+    SequenceTable m_sequenceTable;
+    ParamsWatcher m_paramsWatcher;
+    rack::dsp::ClockDivider m_paramsCheckDivider;
+    VoicePositions m_voicePositions[2];
+    size_t m_voicePositionsIndex = 0;
+    LatticeIndexBuilder m_latticeIndexBuilder;
+
+    // The distribution is only worked out while a panel is showing it, and only republished on
+    // a light update after the InputVector or params move (or every light update while CVs are
+    // patched).  ProcessOutputs writes it from its own evaluation.
+    //
+    Snapshot<CandidateDistribution> m_distribution;
+    std::atomic<bool> m_distributionDisplayed{false};
+    InputVector m_distributionVector;
+    uint32_t m_distributionParamsGeneration = 0;
 };
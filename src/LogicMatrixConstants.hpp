@@ -17,6 +17,10 @@ namespace LogicMatrixConstants
     static constexpr size_t x_numOperations = 6;
     static constexpr size_t x_numAccumulators = 3;
 
+    // The most inputs an operation can count high: its gate inputs and every other operation.
+    //
+    static constexpr size_t x_maxOperatorK = x_numInputs + x_numOperations - 1;
+
     static constexpr size_t x_numParamsPerType[] =
     {
         x_numInputs * x_numOperations /*MatrixSwitch*/,
@@ -220,4 +224,48 @@ namespace LogicMatrixConstants
     {
         return x_lightStartPerType[static_cast<int>(LightType::NumLightTypes)];
     }
+
+    // Lights and displays are only refreshed every x_lightDivisions[i] samples.
+    // Gate and pitch outputs are unaffected and still run at audio rate.
+    //
+    static constexpr uint32_t x_lightDivisions[] = {1, 16, 64, 256};
+    static constexpr size_t x_numLightDivisions = 4;
+    static constexpr size_t x_defaultLightDivisionIndex = 2;
+
+    // The pitch each interval knob setting adds per high operation, in volts, as log_2 of the
+    // interval's ratio.  Shared with the solver, so it ranks pitches with the module's own values.
+    //
+    static constexpr size_t x_numIntervals = 9;
+    static constexpr float x_intervalVoltages[x_numIntervals] = {
+        0 /*Off*/,
+        0.09310940439 /*half step = log_2(16/15)*/,
+        0.16992500144231237/*whole tone = log_2(9/8)*/,
+        0.2630344058337938 /*minor third = log_2(6/5)*/,
+        0.32192809488736235 /*major third = log_2(5/4)*/,
+        0.4150374992788437 /*perfect fourth = log_2(4/3)*/,
+        0.5849625007211562 /*perfect fifth = log_2(3/2)*/,
+        0.8073549220576041 /*minor seventh = log_2(7/4)*/,
+        1.0 /*octave = log_2(2)*/
+    };
+
+    // What each operator knob setting (OR, AND, XOR, at least two, majority) outputs with
+    // countHigh of an operation's countTotal active inputs high.  Shared with the solver, so it
+    // compiles operations the way the module does.
+    //
+    static constexpr size_t x_numKnobOperators = 5;
+
+    static constexpr bool GetKnobOperatorValue(size_t knobOperator, size_t countHigh, size_t countTotal)
+    {
+        return knobOperator == 0 ? countHigh > 0 :
+            knobOperator == 1 ? countHigh == countTotal :
+            knobOperator == 2 ? countHigh % 2 == 1 :
+            knobOperator == 3 ? countHigh >= 2 :
+            knobOperator == 4 ? 2 * countHigh > countTotal :
+            false;
+    }
+
+    // Params and the module state are checked for changes every x_paramsCheckDivision samples.
+    // A knob lands less than a millisecond late, and most samples skip the scan.
+    //
+    static constexpr uint32_t x_paramsCheckDivision = 32;
 }
@@ -2,6 +2,342 @@
 
 struct LogicMatrixWidget : ModuleWidget
 {
+    typedef LogicMatrix::LogicOperation::OperatorDefinition OperatorDefinition;
+
+    // Takes a 64 bit truth table as hex, bit i being the output for masked input vector i.
+    //
+    struct TruthTableField : ui::TextField
+    {
+        LogicMatrix* m_module = nullptr;
+        size_t m_operationId = 0;
+
+        void onAction(const ActionEvent& e) override
+        {
+            OperatorDefinition definition;
+            definition.m_type = OperatorDefinition::Type::TruthTable;
+            definition.m_truthTable = strtoull(text.c_str(), nullptr, 16);
+            m_module->m_operations[m_operationId].SetDefinition(definition);
+
+            ui::MenuOverlay* overlay = getAncestorOfType<ui::MenuOverlay>();
+            if (overlay)
+            {
+                overlay->requestDelete();
+            }
+        }
+    };
+
+    // Takes the random seed in decimal, and restarts the random sequence from it.
+    //
+    struct SeedField : ui::TextField
+    {
+        LogicMatrix* m_module = nullptr;
+
+        void onAction(const ActionEvent& e) override
+        {
+            m_module->m_seed.store(static_cast<uint32_t>(strtoul(text.c_str(), nullptr, 10)));
+            m_module->m_reseedRequested.store(true);
+
+            ui::MenuOverlay* overlay = getAncestorOfType<ui::MenuOverlay>();
+            if (overlay)
+            {
+                overlay->requestDelete();
+            }
+        }
+    };
+
+    static void AppendOperatorMenu(Menu* menu, LogicMatrix* module, size_t operationId)
+    {
+        using namespace LogicMatrixConstants;
+        typedef OperatorDefinition::Type Type;
+
+        LogicMatrix::LogicOperation* operation = &module->m_operations[operationId];
+        auto addItem = [=](Menu* menu, std::string name, Type type, uint8_t k)
+        {
+            menu->addChild(createCheckMenuItem(
+                               name,
+                               "",
+                               [=]()
+                               {
+                                   bool usesK = type == Type::AtLeast || type == Type::Exactly;
+                                   OperatorDefinition definition = operation->GetDefinition();
+                                   return definition.m_type == type && (!usesK || definition.m_k == k);
+                               },
+                               [=]()
+                               {
+                                   OperatorDefinition definition;
+                                   definition.m_type = type;
+                                   definition.m_k = k;
+                                   operation->SetDefinition(definition);
+                               }));
+        };
+
+        addItem(menu, "Knob", Type::Knob, 1);
+        addItem(menu, "NAND", Type::Nand, 1);
+        addItem(menu, "NOR", Type::Nor, 1);
+        menu->addChild(createSubmenuItem("At least", "", [=](Menu* menu)
+        {
+            for (size_t k = 0; k <= x_maxOperatorK; ++k)
+            {
+                addItem(menu, std::to_string(k), Type::AtLeast, k);
+            }
+        }));
+        menu->addChild(createSubmenuItem("Exactly", "", [=](Menu* menu)
+        {
+            for (size_t k = 0; k <= x_maxOperatorK; ++k)
+            {
+                addItem(menu, std::to_string(k), Type::Exactly, k);
+            }
+        }));
+
+        char truthTable[17];
+        snprintf(truthTable, sizeof(truthTable), "%016llx", static_cast<unsigned long long>(operation->GetDefinition().m_truthTable));
+
+        menu->addChild(createMenuLabel("Truth table (hex, enter to apply)"));
+        TruthTableField* field = new TruthTableField();
+        field->box.size.x = 150;
+        field->m_module = module;
+        field->m_operationId = operationId;
+        field->setText(truthTable);
+        menu->addChild(field);
+
+        // Operations that already depend on this one can't feed it.
+        //
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createSubmenuItem("Inputs from other operations", "", [=](Menu* menu)
+        {
+            for (size_t i = 0; i < x_numOperations; ++i)
+            {
+                if (i == operationId)
+                {
+                    continue;
+                }
+
+                bool loops = module->OperationDependsOn(i, operationId);
+                menu->addChild(createCheckMenuItem(
+                                   "Operation " + std::to_string(i),
+                                   loops ? "would loop" : "",
+                                   [=]() { return (operation->GetOperationInputs() >> i) & 1; },
+                                   [=]() { operation->SetOperationInputs(operation->GetOperationInputs() ^ (1 << i)); },
+                                   loops));
+            }
+        }));
+    }
+
+    // One row per voice: a tick for every candidate pitch on the voice's own pitch range, with
+    // the one picked by the percentile highlighted.  Redrawn only when the module publishes.
+    //
+    struct CandidateDisplay : FramebufferWidget
+    {
+        struct Drawer : TransparentWidget
+        {
+            CandidateDisplay* m_display = nullptr;
+
+            void draw(const DrawArgs& args) override
+            {
+                m_display->DrawDistribution(args.vg);
+            }
+        };
+
+        LogicMatrix* m_module = nullptr;
+        LogicMatrix::CandidateDistribution m_distribution;
+        uint32_t m_generation = 0;
+
+        void Init(LogicMatrix* module, Vec size)
+        {
+            m_module = module;
+            box.size = size;
+
+            Drawer* drawer = new Drawer();
+            drawer->m_display = this;
+            drawer->box.size = size;
+            addChild(drawer);
+
+            if (m_module)
+            {
+                m_module->m_distributionDisplayed.store(true);
+            }
+        }
+
+        ~CandidateDisplay()
+        {
+            if (m_module)
+            {
+                m_module->m_distributionDisplayed.store(false);
+            }
+        }
+
+        void step() override
+        {
+            if (m_module && m_module->m_distribution.Read(&m_distribution, &m_generation))
+            {
+                setDirty();
+            }
+
+            FramebufferWidget::step();
+        }
+
+        void DrawDistribution(NVGcontext* vg)
+        {
+            using namespace LogicMatrixConstants;
+
+            static const NVGcolor x_bgColor = nvgRGB(0x00, 0x00, 0x00);
+            static const NVGcolor x_tickColor = nvgRGB(0x66, 0x66, 0x66);
+            static const NVGcolor x_selectedColors[] = {
+                nvgRGB(0xed, 0x2c, 0x24),
+                nvgRGB(0x90, 0xc7, 0x3e),
+                nvgRGB(0x29, 0xb2, 0xef)
+            };
+
+            float rowHeight = box.size.y / x_numAccumulators;
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                float y = i * rowHeight;
+                nvgBeginPath(vg);
+                nvgRoundedRect(vg, 0, y + 1, box.size.x, rowHeight - 2, 2.0);
+                nvgFillColor(vg, x_bgColor);
+                nvgFill(vg);
+
+                const LogicMatrix::CandidateDistribution::Voice& voice = m_distribution.m_voices[i];
+                if (voice.m_numCandidates == 0)
+                {
+                    continue;
+                }
+
+                // Pitches are sorted, so the ends of the row are the lowest and highest candidates.
+                //
+                float low = voice.m_pitches[0];
+                float range = std::max(voice.m_pitches[voice.m_numCandidates - 1] - low, 1.0f / 12);
+                float width = box.size.x - 4;
+                for (size_t j = 0; j < voice.m_numCandidates; ++j)
+                {
+                    bool selected = j == voice.m_selected;
+                    float x = 2 + width * (voice.m_pitches[j] - low) / range;
+                    nvgBeginPath(vg);
+                    nvgRect(vg, x - (selected ? 1.0 : 0.5), y + 2, selected ? 2.0 : 1.0, rowHeight - 4);
+                    nvgFillColor(vg, selected ? x_selectedColors[i] : x_tickColor);
+                    nvgFill(vg);
+                }
+            }
+        }
+    };
+
+    // A whole grid of NKK-style toggles drawn in one pass, instead of a separate SVG widget and
+    // framebuffer per switch.  The cells are the same params as before, so patches are unchanged,
+    // and the grid is only redrawn when one of its values changes.  Each cell is still a Switch
+    // param widget, just an invisible one laid over the drawing, so clicking, tooltips, the param
+    // context menu, undo and MIDI mapping all work as for any other switch.
+    //
+    struct SwitchGrid : FramebufferWidget
+    {
+        struct Cell : app::Switch
+        {
+            Cell()
+            {
+                box.size = mm2px(Vec(x_hp * x_switchWidthHP, x_hp * x_switchHeightHP));
+            }
+        };
+
+        struct Drawer : TransparentWidget
+        {
+            SwitchGrid* m_grid = nullptr;
+
+            void draw(const DrawArgs& args) override
+            {
+                m_grid->DrawSwitches(args.vg);
+            }
+        };
+
+        typedef size_t (*ParamIdFn)(size_t column, size_t row);
+
+        static constexpr float x_switchWidthHP = 1.2;
+        static constexpr float x_switchHeightHP = 2.4;
+
+        LogicMatrix* m_module = nullptr;
+        ParamIdFn m_paramId = nullptr;
+        size_t m_numColumns = 0;
+        size_t m_numRows = 0;
+        Vec m_spacingMM;
+
+        // Every switch in both grids defaults to 1.
+        //
+        std::vector<float> m_values;
+
+        // firstMM is the center of the top left switch.
+        //
+        void Init(LogicMatrix* module, ParamIdFn paramId, size_t numColumns, size_t numRows, Vec firstMM, Vec spacingMM)
+        {
+            m_module = module;
+            m_paramId = paramId;
+            m_numColumns = numColumns;
+            m_numRows = numRows;
+            m_spacingMM = spacingMM;
+            m_values.assign(numColumns * numRows, 1.f);
+
+            box.pos = mm2px(firstMM.minus(spacingMM.div(2)));
+            box.size = mm2px(Vec(spacingMM.x * numColumns, spacingMM.y * numRows));
+
+            Drawer* drawer = new Drawer();
+            drawer->m_grid = this;
+            drawer->box.size = box.size;
+            addChild(drawer);
+        }
+
+        void step() override
+        {
+            if (m_module)
+            {
+                for (size_t i = 0; i < m_numColumns; ++i)
+                {
+                    for (size_t j = 0; j < m_numRows; ++j)
+                    {
+                        float value = m_module->params[m_paramId(i, j)].getValue();
+                        float& cached = m_values[i + j * m_numColumns];
+                        if (value != cached)
+                        {
+                            cached = value;
+                            setDirty();
+                        }
+                    }
+                }
+            }
+
+            FramebufferWidget::step();
+        }
+
+        Vec GetSwitchCenterMM(size_t column, size_t row)
+        {
+            return Vec(m_spacingMM.x * (column + 0.5f), m_spacingMM.y * (row + 0.5f));
+        }
+
+        // Position 0 is lever up, as on the NKK.
+        //
+        void DrawSwitches(NVGcontext* vg)
+        {
+            static const NVGcolor x_bodyColor = nvgRGB(0x22, 0x22, 0x22);
+            static const NVGcolor x_leverColor = nvgRGB(0xcc, 0xcc, 0xcc);
+
+            Vec size = mm2px(Vec(x_hp * x_switchWidthHP, x_hp * x_switchHeightHP));
+            float leverHeight = size.y / 3;
+            for (size_t i = 0; i < m_numColumns; ++i)
+            {
+                for (size_t j = 0; j < m_numRows; ++j)
+                {
+                    Vec center = mm2px(GetSwitchCenterMM(i, j));
+                    nvgBeginPath(vg);
+                    nvgRoundedRect(vg, center.x - size.x / 2, center.y - size.y / 2, size.x, size.y, 2.0);
+                    nvgFillColor(vg, x_bodyColor);
+                    nvgFill(vg);
+
+                    float position = std::min(std::max(m_values[i + j * m_numColumns], 0.f), 2.f);
+                    nvgBeginPath(vg);
+                    nvgRoundedRect(vg, center.x - size.x / 2 + 1, center.y - size.y / 2 + position * leverHeight + 1, size.x - 2, leverHeight - 2, 1.5);
+                    nvgFillColor(vg, x_leverColor);
+                    nvgFill(vg);
+                }
+            }
+        }
+    };
+
     static constexpr float x_hp = 5.08;
 
     static constexpr float x_jackLightOffsetHP = 1.0;
@@ -29,6 +365,11 @@ struct LogicMatrixWidget : ModuleWidget
     static constexpr float x_firstCoMuteXHP = 29.5;
     static constexpr float x_firstCoMuteYHP = 15.75;
 
+    static constexpr float x_candidateDisplayXHP = 1.0;
+    static constexpr float x_candidateDisplayYHP = 20.5;
+    static constexpr float x_candidateDisplayWidthHP = 8.5;
+    static constexpr float x_candidateDisplayHeightHP = 3.0;
+
     Vec GetInputJackMM(size_t inputId)
     {
         return Vec(x_hp + 2.5,
@@ -124,10 +465,22 @@ struct LogicMatrixWidget : ModuleWidget
                           mm2px(JackToLight(GetInputJackMM(i))),
                           module,
                           GetInputLightId(i)));
+        }
+
+        Vec switchSpacingMM(x_hp * x_switchSpacingXHP, x_hp * x_rowYSpacing);
+        SwitchGrid* matrixGrid = new SwitchGrid();
+        matrixGrid->Init(module, GetMatrixSwitchId, x_numInputs, x_numOperations, GetMatrixSwitchMM(0, 0), switchSpacingMM);
+        addChild(matrixGrid);
+
+        SwitchGrid* coMuteGrid = new SwitchGrid();
+        coMuteGrid->Init(module, GetPitchCoMuteSwitchId, x_numInputs, x_numAccumulators, GetCoMuteSwitchMM(0, 0), switchSpacingMM);
+        addChild(coMuteGrid);
 
+        for (size_t i = 0; i < x_numInputs; ++i)
+        {
             for (size_t j = 0; j < x_numOperations; ++j)
             {
-                addParam(createParamCentered<NKK>(
+                addParam(createParamCentered<SwitchGrid::Cell>(
                              mm2px(GetMatrixSwitchMM(i, j)),
                              module,
                              GetMatrixSwitchId(i, j)));
@@ -135,10 +488,10 @@ struct LogicMatrixWidget : ModuleWidget
 
             for (size_t j = 0; j < x_numAccumulators; ++j)
             {
-                addParam(createParamCentered<NKK>(
+                addParam(createParamCentered<SwitchGrid::Cell>(
                              mm2px(GetCoMuteSwitchMM(i, j)),
                              module,
-                             GetPitchCoMuteSwitchId(i, j)));                
+                             GetPitchCoMuteSwitchId(i, j)));
             }
         }
 
@@ -196,7 +549,174 @@ struct LogicMatrixWidget : ModuleWidget
                          GetPitchPercentileKnobId(i)));
 
         }
+
+        CandidateDisplay* display = createWidget<CandidateDisplay>(
+            mm2px(Vec(x_hp * x_candidateDisplayXHP, x_hp * x_candidateDisplayYHP)));
+        display->Init(module, mm2px(Vec(x_hp * x_candidateDisplayWidthHP, x_hp * x_candidateDisplayHeightHP)));
+        addChild(display);
 	}
+
+    void appendContextMenu(Menu* menu) override
+    {
+        using namespace LogicMatrixConstants;
+
+        LogicMatrix* module = dynamic_cast<LogicMatrix*>(this->module);
+        if (!module)
+        {
+            return;
+        }
+
+        std::vector<std::string> labels;
+        for (size_t i = 0; i < x_numLightDivisions; ++i)
+        {
+            labels.push_back(x_lightDivisions[i] == 1 ? "Every sample" : "Every " + std::to_string(x_lightDivisions[i]) + " samples");
+        }
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createSubmenuItem("Operators", "", [=](Menu* menu)
+        {
+            for (size_t i = 0; i < x_numOperations; ++i)
+            {
+                menu->addChild(createSubmenuItem(
+                                   "Operation " + std::to_string(i),
+                                   module->m_operations[i].GetDefinition().GetName(),
+                                   [=](Menu* menu) { AppendOperatorMenu(menu, module, i); }));
+            }
+        }));
+
+        menu->addChild(createIndexSubmenuItem(
+                           "Unpatched inputs from left LogicMatrix",
+                           {"Off (divide-by-two)", "Its inputs", "Its logic outputs"},
+                           [=]() { return static_cast<size_t>(module->GetChainMode()); },
+                           [=](size_t index) { module->SetChainMode(static_cast<LogicMatrix::ChainMode>(index)); }));
+
+        menu->addChild(createSubmenuItem("Voice selection", "", [=](Menu* menu)
+        {
+            for (size_t i = 0; i < x_numAccumulators; ++i)
+            {
+                menu->addChild(createIndexSubmenuItem(
+                                   "Voice " + std::to_string(i + 1),
+                                   {"Percentile", "Random lattice point", "Random, weighted by input vectors"},
+                                   [=]() { return static_cast<size_t>(module->GetSelection(i)); },
+                                   [=](size_t index) { module->SetSelection(i, static_cast<LogicMatrix::Selection>(index)); }));
+            }
+
+            menu->addChild(createBoolMenuItem(
+                               "Distinct pitches only",
+                               "",
+                               [=]() { return module->m_distinctPitches.load(); },
+                               [=](bool enable) { module->m_distinctPitches.store(enable); }));
+
+            menu->addChild(new MenuSeparator);
+            menu->addChild(createMenuLabel("Random seed (enter to apply)"));
+            SeedField* field = new SeedField();
+            field->box.size.x = 150;
+            field->m_module = module;
+            field->setText(std::to_string(module->m_seed.load()));
+            menu->addChild(field);
+            menu->addChild(createMenuItem(
+                               "Restart random sequence",
+                               "",
+                               [=]() { module->m_reseedRequested.store(true); }));
+        }));
+
+        menu->addChild(createIndexSubmenuItem(
+                           "Light update rate",
+                           labels,
+                           [=]() { return module->m_lightDivisionIndex.load(); },
+                           [=](size_t index) { module->SetLightDivisionIndex(index); }));
+
+        std::string tracePath = asset::user("LogicMatrix-" + std::to_string(module->id) + ".trace.json");
+        menu->addChild(createBoolMenuItem(
+                           "Trace timeline to file",
+                           "",
+                           [=]() { return module->m_tracer.IsEnabled(); },
+                           [=](bool enable)
+                           {
+                               if (enable)
+                               {
+                                   module->m_tracer.Start(tracePath, module->id);
+                               }
+                               else
+                               {
+                                   module->m_tracer.Stop();
+                               }
+                           }));
+
+        // The LatticeExpander on the right, if any, measures the hop to its lights at the same
+        // time, and its histograms go in the same report.
+        //
+        std::string latencyPath = asset::user("LogicMatrix-" + std::to_string(module->id) + ".latency.json");
+        menu->addChild(createBoolMenuItem(
+                           "Measure latency to file",
+                           "",
+                           [=]() { return module->m_latency.IsEnabled(); },
+                           [=](bool enable)
+                           {
+                               LatticeExpander* expander = nullptr;
+                               if (module->rightExpander.module && module->rightExpander.module->model == modelLatticeExpander)
+                               {
+                                   expander = static_cast<LatticeExpander*>(module->rightExpander.module);
+                               }
+
+                               if (enable)
+                               {
+                                   module->m_latency.Start();
+                                   if (expander)
+                                   {
+                                       expander->m_latency.Start();
+                                   }
+                               }
+                               else
+                               {
+                                   Latency::Meter* meters[] = {&module->m_latency, expander ? &expander->m_latency : nullptr};
+                                   module->m_latency.Stop();
+                                   if (expander)
+                                   {
+                                       expander->m_latency.Stop();
+                                   }
+
+                                   Latency::WriteReport(
+                                       latencyPath,
+                                       meters,
+                                       expander ? 2 : 1,
+                                       x_lightDivisions[module->m_lightDivisionIndex.load()],
+                                       APP->engine->getSampleRate());
+                               }
+                           }));
+
+        std::string recordingPath = asset::user("LogicMatrix-" + std::to_string(module->id) + ".lmrec");
+        menu->addChild(createBoolMenuItem(
+                           "Record inputs to file",
+                           "",
+                           [=]() { return module->m_recorder.IsEnabled(); },
+                           [=](bool enable)
+                           {
+                               if (enable)
+                               {
+                                   module->m_recorder.Start(recordingPath);
+                               }
+                               else
+                               {
+                                   module->m_recorder.Stop();
+                               }
+                           }));
+        menu->addChild(createBoolMenuItem(
+                           "Replay recording",
+                           "",
+                           [=]() { return module->m_player.IsPlaying(); },
+                           [=](bool enable)
+                           {
+                               if (enable)
+                               {
+                                   module->m_player.Load(recordingPath);
+                               }
+                               else
+                               {
+                                   module->m_player.Stop();
+                               }
+                           }));
+    }
 };
 
 Model* modelLogicMatrix = createModel<LogicMatrix, LogicMatrixWidget>("LogicMatrix");
@@ -0,0 +1,395 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "LogicMatrixConstants.hpp"
+#include "RingBuffer.hpp"
+
+// Recording and deterministic replay of everything LogicMatrix reads from the outside world.
+//
+// A recording file is a Header followed by a flat array of fixed-size Records, so it can be
+// memory-mapped and indexed directly.  The first records written are a State record, a
+// Random record, one Operator record per operation, a Candidates record and one Param
+// record per param, which is enough to put the engine back in the state it was in when
+// recording started.  After that, each sample is zero or more Random (after a reseed),
+// Param, Operator or Candidates records (for whatever changed) followed by exactly one
+// Sample record.  Sample records hold the
+// InputVector after chaining, so the chain mode isn't needed.
+//
+// The version goes up whenever the format changes, and a player only loads its own.
+//
+namespace Recording
+{
+    static constexpr char x_magic[8] = {'L', 'M', 'J', 'R', 'E', 'C', '\0', '\0'};
+    static constexpr uint32_t x_version = 3;
+    static constexpr size_t x_numValues = 7;
+
+    // 1.4 seconds at 48kHz.
+    //
+    static constexpr size_t x_ringBufferSize = 1 << 16;
+    static constexpr int x_flushIntervalMs = 10;
+
+    struct Header
+    {
+        char m_magic[8];
+        uint32_t m_version;
+        uint32_t m_recordSize;
+        uint64_t m_numDropped;
+
+        Header()
+        {
+            memcpy(m_magic, x_magic, sizeof(m_magic));
+            m_version = x_version;
+            m_recordSize = 0;
+            m_numDropped = 0;
+        }
+    };
+
+    struct Record
+    {
+        enum class Type : uint8_t
+        {
+            // m_inputVector, percentile CVs then interval CVs in m_values, and the voices that
+            // were listened to as a bit mask in m_words[6].
+            //
+            Sample = 0,
+
+            // m_paramId and its value in m_values[0].
+            //
+            Param = 1,
+
+            // Output pitches, then pulse generator remaining times, then the sample rate.
+            // m_inputVector is the voices that were active, as a bit mask.
+            //
+            State = 2,
+
+            // The definition of operation m_paramId: its truth table low word then high word,
+            // its type, k and operation inputs, in m_words.
+            //
+            Operator = 3,
+
+            // Each voice's scale mask, low word then high word, then distinct pitches with each
+            // voice's selection in the bytes above it, in m_words.
+            //
+            Candidates = 4,
+
+            // The random generator's state in m_words[0..3], the seed it came from, then the
+            // last step's InputVector with each voice's drawn candidate in the bytes above it.
+            //
+            Random = 5
+        };
+
+        Type m_type;
+        uint8_t m_inputVector;
+        uint16_t m_paramId;
+        union
+        {
+            float m_values[x_numValues];
+            uint32_t m_words[x_numValues];
+        };
+    };
+
+    static_assert(sizeof(Record) == 32, "Recording::Record is written to disk as is");
+
+    struct Recorder
+    {
+        std::unique_ptr<RingBuffer<Record, x_ringBufferSize>> m_ringBuffer;
+        std::atomic<bool> m_enabled;
+
+        // Set by the audio thread between BeginPushes and EndPushes, so Stop can wait for the
+        // sample being recorded before the final flush.
+        //
+        std::atomic<bool> m_pushing;
+        std::atomic<uint64_t> m_numDropped;
+        std::thread m_writeThread;
+
+        // Wakes the write thread early when stopping.  m_stopRequested is guarded by m_mutex.
+        //
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        bool m_stopRequested = false;
+
+        FILE* m_file = nullptr;
+
+        // Audio thread state.  m_needsState is set when recording starts, so the audio thread
+        // writes the initial records before the first Sample.  m_needsRandom is set when the
+        // random generator is reseeded.
+        //
+        bool m_needsState = false;
+        bool m_needsRandom = false;
+        float m_lastParams[LogicMatrixConstants::GetNumParams()];
+        Record m_lastOperators[LogicMatrixConstants::x_numOperations];
+        Record m_lastCandidates;
+
+        Recorder()
+            : m_enabled(false)
+            , m_pushing(false)
+            , m_numDropped(0)
+        {
+        }
+
+        ~Recorder()
+        {
+            Stop();
+        }
+
+        // Acquire, so a true here also means the ring buffer Start allocated is visible.
+        //
+        bool IsEnabled()
+        {
+            return m_enabled.load(std::memory_order_acquire);
+        }
+
+        // Audio thread.  Brackets the records pushed for one sample, and returns false if not
+        // recording.  Stop clears m_enabled and then waits for m_pushing, so one of the two sees
+        // the other's store and nothing is pushed after the final flush.
+        //
+        bool BeginPushes()
+        {
+            if (!IsEnabled())
+            {
+                return false;
+            }
+
+            m_pushing.store(true);
+            if (!m_enabled.load())
+            {
+                m_pushing.store(false, std::memory_order_release);
+                return false;
+            }
+
+            return true;
+        }
+
+        void EndPushes()
+        {
+            m_pushing.store(false, std::memory_order_release);
+        }
+
+        void Push(const Record& record)
+        {
+            if (!m_ringBuffer->Push(record))
+            {
+                m_numDropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // For records of state that changes rarely.  Pushes the record if it differs from the last
+        // one of its kind, or if recording just started.  Records are zeroed before they are
+        // filled in, so comparing the bytes is enough.
+        //
+        void PushIfChanged(const Record& record, Record* last)
+        {
+            if (m_needsState || memcmp(&record, last, sizeof(Record)) != 0)
+            {
+                Push(record);
+                *last = record;
+            }
+        }
+
+        // Called from the UI thread.
+        //
+        bool Start(const std::string& path)
+        {
+            Stop();
+
+            m_file = std::fopen(path.c_str(), "wb");
+            if (!m_file)
+            {
+                return false;
+            }
+
+            Header header;
+            header.m_recordSize = sizeof(Record);
+            std::fwrite(&header, sizeof(Header), 1, m_file);
+
+            m_numDropped.store(0);
+
+            // As with the tracer, the buffer outlives each recording so the audio thread never
+            // pushes into freed memory.
+            //
+            if (!m_ringBuffer)
+            {
+                m_ringBuffer.reset(new RingBuffer<Record, x_ringBufferSize>());
+            }
+
+            m_ringBuffer->Clear();
+            m_needsState = true;
+            m_stopRequested = false;
+            m_writeThread = std::thread([this]() { WriteLoop(); });
+            m_enabled.store(true, std::memory_order_release);
+            return true;
+        }
+
+        // Called from the UI thread.  Rewrites the header with the number of dropped records,
+        // which Player::Load checks.
+        //
+        void Stop()
+        {
+            if (!m_file)
+            {
+                return;
+            }
+
+            m_enabled.store(false);
+            while (m_pushing.load())
+            {
+                std::this_thread::yield();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopRequested = true;
+            }
+
+            m_wake.notify_one();
+            m_writeThread.join();
+
+            Header header;
+            header.m_recordSize = sizeof(Record);
+            header.m_numDropped = m_numDropped.load();
+            std::fseek(m_file, 0, SEEK_SET);
+            std::fwrite(&header, sizeof(Header), 1, m_file);
+            std::fclose(m_file);
+            m_file = nullptr;
+        }
+
+        void WriteLoop()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                bool stopRequested = m_stopRequested;
+                lock.unlock();
+                Flush();
+                lock.lock();
+
+                if (stopRequested)
+                {
+                    break;
+                }
+
+                m_wake.wait_for(lock, std::chrono::milliseconds(x_flushIntervalMs), [this]() { return m_stopRequested; });
+            }
+        }
+
+        void Flush()
+        {
+            Record record;
+            while (m_ringBuffer->Pop(&record))
+            {
+                std::fwrite(&record, sizeof(Record), 1, m_file);
+            }
+
+            std::fflush(m_file);
+        }
+    };
+
+    struct Player
+    {
+        enum class State : int
+        {
+            Idle = 0,
+            Playing = 1
+        };
+
+        // The records are only touched by the UI thread while Idle, and only by the audio thread
+        // otherwise.  The audio thread is the one that moves the state back to Idle.
+        //
+        std::atomic<int> m_state;
+        std::atomic<bool> m_stopRequested;
+        Header m_header;
+        std::vector<Record> m_records;
+        size_t m_position = 0;
+
+        Player()
+            : m_state(static_cast<int>(State::Idle))
+            , m_stopRequested(false)
+        {
+        }
+
+        State GetState()
+        {
+            return static_cast<State>(m_state.load(std::memory_order_acquire));
+        }
+
+        bool IsPlaying()
+        {
+            return GetState() == State::Playing;
+        }
+
+        // Called from the UI thread.  A recording that dropped records has gaps that can't be
+        // replayed exactly, so it isn't loaded.
+        //
+        bool Load(const std::string& path)
+        {
+            if (IsPlaying())
+            {
+                return false;
+            }
+
+            FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file)
+            {
+                return false;
+            }
+
+            bool ok = std::fread(&m_header, sizeof(Header), 1, file) == 1 &&
+                memcmp(m_header.m_magic, x_magic, sizeof(x_magic)) == 0 &&
+                m_header.m_version == x_version &&
+                m_header.m_recordSize == sizeof(Record) &&
+                m_header.m_numDropped == 0;
+
+            m_records.clear();
+            Record record;
+            while (ok && std::fread(&record, sizeof(Record), 1, file) == 1)
+            {
+                m_records.push_back(record);
+            }
+
+            std::fclose(file);
+            if (!ok || m_records.empty())
+            {
+                return false;
+            }
+
+            m_position = 0;
+            m_stopRequested.store(false);
+            m_state.store(static_cast<int>(State::Playing), std::memory_order_release);
+            return true;
+        }
+
+        // Called from the UI thread.
+        //
+        void Stop()
+        {
+            m_stopRequested.store(true);
+        }
+
+        // Audio thread.  Returns the next record, or nullptr once playback is over.
+        //
+        const Record* Next()
+        {
+            if (m_stopRequested.load(std::memory_order_relaxed) || m_position >= m_records.size())
+            {
+                return nullptr;
+            }
+
+            return &m_records[m_position++];
+        }
+
+        // Audio thread.
+        //
+        void Finish()
+        {
+            m_state.store(static_cast<int>(State::Idle), std::memory_order_release);
+        }
+    };
+}
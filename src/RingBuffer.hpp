@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Single-producer, single-consumer lock-free ring buffer.  The audio thread is the producer
+// and never blocks; if the consumer has fallen behind, Push fails and the item is dropped.
+//
+template<typename T, size_t Size>
+struct RingBuffer
+{
+    std::unique_ptr<T[]> m_items;
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+
+    RingBuffer()
+        : m_items(new T[Size])
+        , m_head(0)
+        , m_tail(0)
+    {
+    }
+
+    bool Push(const T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) >= Size)
+        {
+            return false;
+        }
+
+        m_items[head % Size] = item;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T* item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        *item = m_items[tail % Size];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.  Drops everything pushed so far.
+    //
+    void Clear()
+    {
+        m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Single-writer seqlock for handing a small struct from one thread to another: display state
+// from the audio thread to the UI, and operator definitions the other way.  The writer fills
+// m_value in place between BeginWrite and EndWrite, so nothing is copied on the audio thread
+// unless there is something new to say.  The generation is odd while
+// a write is in progress.
+//
+template<typename T>
+struct Snapshot
+{
+    T m_value;
+    std::atomic<uint32_t> m_generation;
+
+    Snapshot()
+        : m_generation(0)
+    {
+    }
+
+    T& BeginWrite()
+    {
+        uint32_t generation = m_generation.load(std::memory_order_relaxed);
+        m_generation.store(generation + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return m_value;
+    }
+
+    void EndWrite()
+    {
+        m_generation.store(m_generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Called from the reading thread.  Returns false if nothing changed since *generation, or if
+    // the writer was mid-update, in which case *value is left alone and the caller tries again
+    // later.
+    //
+    bool Read(T* value, uint32_t* generation)
+    {
+        uint32_t before = m_generation.load(std::memory_order_acquire);
+        if (before == *generation || before % 2 == 1)
+        {
+            return false;
+        }
+
+        T copy = m_value;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_generation.load(std::memory_order_relaxed) != before)
+        {
+            return false;
+        }
+
+        *value = copy;
+        *generation = before;
+        return true;
+    }
+};
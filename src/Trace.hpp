@@ -0,0 +1,244 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "RingBuffer.hpp"
+
+// Opt-in timeline tracing.  The audio thread pushes begin/end events into a single-producer,
+// single-consumer ring buffer, and a background thread writes them out as a Chrome trace
+// (the JSON format loaded by chrome://tracing and ui.perfetto.dev).
+//
+namespace Trace
+{
+    enum class Stage : uint8_t
+    {
+        ProcessInputs = 0,
+        ProcessOperations = 1,
+        ComputePitch = 2,
+        SendExpanderMessage = 3,
+        ProcessTextFields = 4,
+        NumStages = 5
+    };
+
+    static constexpr const char* x_stageNames[] = {
+        "ProcessInputs",
+        "ProcessOperations",
+        "ComputePitch",
+        "SendExpanderMessage",
+        "ProcessTextFields"
+    };
+
+    // About 16 events per sample when every stage is traced, so this holds a few hundred
+    // milliseconds of audio between flushes.
+    //
+    static constexpr size_t x_ringBufferSize = 1 << 18;
+    static constexpr int x_flushIntervalMs = 10;
+
+    struct Event
+    {
+        int64_t m_nanos;
+        Stage m_stage;
+        bool m_begin;
+        uint8_t m_inputVector;
+        uint8_t m_coMuteCount;
+    };
+
+    struct Tracer
+    {
+        std::unique_ptr<RingBuffer<Event, x_ringBufferSize>> m_ringBuffer;
+        std::atomic<bool> m_enabled;
+
+        // Set by the audio thread while it is inside Record, so Stop can wait for the last event
+        // to land before the final flush.
+        //
+        std::atomic<bool> m_pushing;
+        std::atomic<size_t> m_numDropped;
+        std::thread m_flushThread;
+
+        // Wakes the flush thread early when stopping.  m_stopRequested is guarded by m_mutex.
+        //
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        bool m_stopRequested = false;
+
+        FILE* m_file = nullptr;
+        int64_t m_pid = 0;
+        bool m_firstEvent = true;
+
+        Tracer()
+            : m_enabled(false)
+            , m_pushing(false)
+            , m_numDropped(0)
+        {
+        }
+
+        ~Tracer()
+        {
+            Stop();
+        }
+
+        static int64_t Now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Acquire, so a true here also means the ring buffer Start allocated is visible.
+        //
+        bool IsEnabled()
+        {
+            return m_enabled.load(std::memory_order_acquire);
+        }
+
+        void Record(Stage stage, bool begin, uint8_t inputVector, size_t coMuteCount)
+        {
+            if (!IsEnabled())
+            {
+                return;
+            }
+
+            // Stop clears m_enabled and then waits for m_pushing, so one of the two sees the
+            // other's store and no event is pushed after the final flush.
+            //
+            m_pushing.store(true);
+            if (!m_enabled.load())
+            {
+                m_pushing.store(false, std::memory_order_release);
+                return;
+            }
+
+            Event event;
+            event.m_nanos = Now();
+            event.m_stage = stage;
+            event.m_begin = begin;
+            event.m_inputVector = inputVector;
+            event.m_coMuteCount = static_cast<uint8_t>(coMuteCount);
+            if (!m_ringBuffer->Push(event))
+            {
+                m_numDropped.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            m_pushing.store(false, std::memory_order_release);
+        }
+
+        void Begin(Stage stage, uint8_t inputVector, size_t coMuteCount = 0)
+        {
+            Record(stage, true, inputVector, coMuteCount);
+        }
+
+        void End(Stage stage, uint8_t inputVector, size_t coMuteCount = 0)
+        {
+            Record(stage, false, inputVector, coMuteCount);
+        }
+
+        // Called from the UI thread.
+        //
+        bool Start(const std::string& path, int64_t pid)
+        {
+            Stop();
+
+            m_file = std::fopen(path.c_str(), "w");
+            if (!m_file)
+            {
+                return false;
+            }
+
+            std::fputs("{\"traceEvents\":[\n", m_file);
+            m_firstEvent = true;
+            m_pid = pid;
+            m_numDropped.store(0);
+
+            // The buffer is allocated once and kept, since the audio thread may still be inside
+            // Record from the previous run when this one starts.
+            //
+            if (!m_ringBuffer)
+            {
+                m_ringBuffer.reset(new RingBuffer<Event, x_ringBufferSize>());
+            }
+
+            m_ringBuffer->Clear();
+            m_stopRequested = false;
+            m_flushThread = std::thread([this]() { FlushLoop(); });
+            m_enabled.store(true, std::memory_order_release);
+            return true;
+        }
+
+        // Called from the UI thread.  Waits for the audio thread to finish any event it is
+        // pushing, then wakes the flush thread to drain the buffer and exit.
+        //
+        void Stop()
+        {
+            if (!m_file)
+            {
+                return;
+            }
+
+            m_enabled.store(false);
+            while (m_pushing.load())
+            {
+                std::this_thread::yield();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopRequested = true;
+            }
+
+            m_wake.notify_one();
+            m_flushThread.join();
+
+            std::fprintf(
+                m_file,
+                "\n],\"otherData\":{\"droppedEvents\":%zu}}\n",
+                m_numDropped.load());
+            std::fclose(m_file);
+            m_file = nullptr;
+        }
+
+        void FlushLoop()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                bool stopRequested = m_stopRequested;
+                lock.unlock();
+                Flush();
+                lock.lock();
+
+                if (stopRequested)
+                {
+                    break;
+                }
+
+                m_wake.wait_for(lock, std::chrono::milliseconds(x_flushIntervalMs), [this]() { return m_stopRequested; });
+            }
+        }
+
+        void Flush()
+        {
+            Event event;
+            while (m_ringBuffer->Pop(&event))
+            {
+                std::fprintf(
+                    m_file,
+                    "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%lld,\"tid\":0,"
+                    "\"args\":{\"inputVector\":%u,\"coMuteCount\":%u}}",
+                    m_firstEvent ? "" : ",\n",
+                    x_stageNames[static_cast<size_t>(event.m_stage)],
+                    event.m_begin ? 'B' : 'E',
+                    event.m_nanos / 1000.0,
+                    static_cast<long long>(m_pid),
+                    static_cast<unsigned>(event.m_inputVector),
+                    static_cast<unsigned>(event.m_coMuteCount));
+                m_firstEvent = false;
+            }
+
+            std::fflush(m_file);
+        }
+    };
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include "plugin.hpp"
+#include <cstddef>
+#include "LogicMatrixConstants.hpp"
+#include "LogicMatrix.hpp"
+
+namespace VoiceExpanderConstants
+{
+    static constexpr size_t x_numVoices = 4;
+
+    enum class ParamType : int
+    {
+        PitchCoMuteSwitch = 0,
+        PitchPercentileKnob = 1,
+        NumParamTypes = 2
+    };
+
+    static constexpr size_t x_numParamsPerType[] =
+    {
+        LogicMatrixConstants::x_numInputs * x_numVoices /*PitchCoMuteSwitch*/,
+        x_numVoices /*PitchPercentileKnob*/
+    };
+
+    static constexpr size_t x_paramStartPerType[] =
+    {
+        0,
+        x_numParamsPerType[0],
+        x_numParamsPerType[0] + x_numParamsPerType[1]
+    };
+
+    static constexpr size_t GetParamId(ParamType paramType, size_t paramId)
+    {
+        return x_paramStartPerType[static_cast<int>(paramType)] + paramId;
+    }
+
+    static constexpr size_t GetPitchCoMuteSwitchId(size_t inputId, size_t voiceId)
+    {
+        return GetParamId(ParamType::PitchCoMuteSwitch, inputId + voiceId * LogicMatrixConstants::x_numInputs);
+    }
+
+    static constexpr size_t GetPitchPercentileKnobId(size_t voiceId)
+    {
+        return GetParamId(ParamType::PitchPercentileKnob, voiceId);
+    }
+
+    static constexpr size_t GetNumParams()
+    {
+        return x_paramStartPerType[static_cast<int>(ParamType::NumParamTypes)];
+    }
+
+    static constexpr size_t GetPitchPercentileCVInputId(size_t voiceId)
+    {
+        return voiceId;
+    }
+
+    static constexpr size_t GetNumInputs()
+    {
+        return x_numVoices;
+    }
+
+    static constexpr size_t GetMainOutputId(size_t voiceId)
+    {
+        return voiceId;
+    }
+
+    static constexpr size_t GetTriggerOutputId(size_t voiceId)
+    {
+        return x_numVoices + voiceId;
+    }
+
+    static constexpr size_t GetNumOutputs()
+    {
+        return 2 * x_numVoices;
+    }
+
+    static constexpr size_t GetTriggerLightId(size_t voiceId)
+    {
+        return voiceId;
+    }
+
+    static constexpr size_t GetNumLights()
+    {
+        return x_numVoices;
+    }
+};
+
+// More voices for the LogicMatrix on the left.  Each has its own co-mute switches and percentile,
+// and picks from the lattice positions the LogicMatrix has already evaluated, so the matrix
+// itself is never run here.  Selection is always by percentile.
+//
+struct VoiceExpander : Module
+{
+    VoiceExpanderMessage m_leftMessages[2][1];
+
+    // What a voice's pitch was last worked out from, so it is only redone when one of them moves.
+    //
+    struct Key
+    {
+        float m_intervalPitches[LogicMatrixConstants::x_numAccumulators];
+        float m_percentile;
+        uint32_t m_paramsGeneration;
+        uint8_t m_inputVector;
+        uint8_t m_coMuteVector;
+
+        Key()
+        {
+            memset(this, 0, sizeof(Key));
+        }
+
+        // Field by field, as the padding after m_coMuteVector is not guaranteed to stay zero
+        // through copies.
+        //
+        bool operator==(const Key& other) const
+        {
+            for (size_t i = 0; i < LogicMatrixConstants::x_numAccumulators; ++i)
+            {
+                if (m_intervalPitches[i] != other.m_intervalPitches[i])
+                {
+                    return false;
+                }
+            }
+
+            return m_percentile == other.m_percentile &&
+                m_paramsGeneration == other.m_paramsGeneration &&
+                m_inputVector == other.m_inputVector &&
+                m_coMuteVector == other.m_coMuteVector;
+        }
+
+        bool operator!=(const Key& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    struct Voice
+    {
+        LogicMatrix::Output m_output;
+        Key m_key;
+        bool m_valid = false;
+    };
+
+    Voice m_voices[VoiceExpanderConstants::x_numVoices];
+    rack::dsp::ClockDivider m_lightDivider;
+
+    VoiceExpander()
+    {
+        using namespace VoiceExpanderConstants;
+
+        config(GetNumParams(), GetNumInputs(), GetNumOutputs(), GetNumLights());
+        for (size_t i = 0; i < x_numVoices; ++i)
+        {
+            for (size_t j = 0; j < LogicMatrixConstants::x_numInputs; ++j)
+            {
+                configParam(GetPitchCoMuteSwitchId(j, i), 0.f, 1.f, 1.f, "Co-Mute Switch " + std::to_string(j) + "," + std::to_string(i));
+            }
+
+            configParam(GetPitchPercentileKnobId(i), 0.f, 1.f, 0.f, "Voice Percentile Knob " + std::to_string(i));
+            configInput(GetPitchPercentileCVInputId(i), "Pitch Percentile CV in " + std::to_string(i));
+            configOutput(GetMainOutputId(i), "Pitch Out " + std::to_string(i));
+            configOutput(GetTriggerOutputId(i), "Trigger " + std::to_string(i));
+
+            m_voices[i].m_output.Init(
+                &outputs[GetMainOutputId(i)],
+                &outputs[GetTriggerOutputId(i)],
+                &lights[GetTriggerLightId(i)]);
+        }
+
+        leftExpander.producerMessage = m_leftMessages[0];
+        leftExpander.consumerMessage = m_leftMessages[1];
+        m_lightDivider.setDivision(LogicMatrixConstants::x_lightDivisions[LogicMatrixConstants::x_defaultLightDivisionIndex]);
+    }
+
+    // The messages hold a pointer into the LogicMatrix, so drop them when it goes away.  Rack
+    // sends this between blocks, never during process.
+    //
+    void onExpanderChange(const ExpanderChangeEvent& e) override
+    {
+        if (e.side == 0)
+        {
+            m_leftMessages[0][0] = VoiceExpanderMessage();
+            m_leftMessages[1][0] = VoiceExpanderMessage();
+        }
+    }
+
+    // The pick LogicMatrix::ComputePitch makes for a voice selecting by percentile, distinct
+    // pitches included.  Scale masks only apply to the LogicMatrix's own voices, so there is no
+    // filtering by mask here.
+    //
+    float ComputePitch(const VoiceExpanderMessage* msg, const Key& key)
+    {
+        using namespace LogicMatrixConstants;
+
+        uint8_t candidates[1 << x_numInputs];
+        size_t numResults = BitKernels::g_expandCoMuteSet(key.m_coMuteVector, key.m_inputVector, candidates);
+
+        LogicMatrix::MatrixEvalResult results[1 << x_numInputs];
+        for (size_t i = 0; i < numResults; ++i)
+        {
+            memcpy(results[i].m_high, msg->m_positions->m_high[candidates[i]], sizeof(results[i].m_high));
+            results[i].SetPitch(key.m_intervalPitches);
+        }
+
+        if (msg->m_distinctPitches)
+        {
+            numResults = LogicMatrix::CollapseDuplicatePitches(results, numResults, msg->m_intervals, msg->m_offsetIntervalCVs);
+        }
+
+        std::sort(results, results + numResults);
+
+        int ix = static_cast<int>(key.m_percentile * numResults);
+        ix = std::min<int>(ix, numResults - 1);
+        ix = std::max<int>(ix, 0);
+        return results[ix].m_pitch;
+    }
+
+    void process(const ProcessArgs& args) override
+    {
+        using namespace VoiceExpanderConstants;
+
+        bool lightTick = m_lightDivider.process();
+
+        VoiceExpanderMessage* msg = static_cast<VoiceExpanderMessage*>(leftExpander.consumerMessage);
+        bool attached = leftExpander.module && leftExpander.module->model == modelLogicMatrix && msg->m_positions;
+
+        for (size_t i = 0; i < x_numVoices; ++i)
+        {
+            Voice& voice = m_voices[i];
+            if (!attached || !voice.m_output.IsConnected())
+            {
+                voice.m_output.m_active = false;
+            }
+            else
+            {
+                Key key;
+                memcpy(key.m_intervalPitches, msg->m_intervalPitches, sizeof(key.m_intervalPitches));
+                key.m_paramsGeneration = msg->m_paramsGeneration;
+                key.m_inputVector = msg->m_inputVector;
+
+                LogicMatrix::InputVector coMuteVector;
+                for (size_t j = 0; j < LogicMatrixConstants::x_numInputs; ++j)
+                {
+                    coMuteVector.Set(j, params[GetPitchCoMuteSwitchId(j, i)].getValue() < 0.5);
+                }
+
+                key.m_coMuteVector = coMuteVector.m_bits;
+
+                float percentile = params[GetPitchPercentileKnobId(i)].getValue() + inputs[GetPitchPercentileCVInputId(i)].getVoltage() / 5.0;
+                key.m_percentile = std::max(std::min(percentile, 1.f), 0.f);
+
+                bool resync = !voice.m_output.m_active;
+                voice.m_output.m_active = true;
+
+                float pitch = voice.m_output.m_pitch;
+                if (resync || !voice.m_valid || key != voice.m_key)
+                {
+                    pitch = ComputePitch(msg, key);
+                    voice.m_key = key;
+                    voice.m_valid = true;
+                }
+
+                if (resync)
+                {
+                    voice.m_output.Resync(pitch);
+                }
+                else
+                {
+                    voice.m_output.SetPitch(pitch, args.sampleTime);
+                }
+            }
+
+            if (lightTick)
+            {
+                voice.m_output.SetLight(args.sampleTime * m_lightDivider.getDivision());
+            }
+        }
+    }
+};
@@ -0,0 +1,96 @@
+#include "VoiceExpander.hpp"
+
+struct VoiceExpanderWidget : ModuleWidget
+{
+    static constexpr float x_hp = 5.08;
+
+    static constexpr float x_firstVoiceYHP = 3.5;
+    static constexpr float x_voiceSpacingYHP = 5.5;
+
+    static constexpr float x_firstCoMuteXHP = 1.5;
+    static constexpr float x_switchSpacingXHP = 1.5;
+
+    static constexpr float x_controlRowOffsetYHP = 2.5;
+    static constexpr float x_percentileKnobXHP = 1.75;
+    static constexpr float x_jackSpacingXHP = 2.2;
+    static constexpr float x_jackLightOffsetHP = 1.0;
+
+    Vec GetCoMuteSwitchMM(size_t inputId, size_t voiceId)
+    {
+        return Vec(x_hp * (x_firstCoMuteXHP + inputId * x_switchSpacingXHP),
+                   x_hp * (x_firstVoiceYHP + voiceId * x_voiceSpacingYHP));
+    }
+
+    Vec GetPercentileKnobMM(size_t voiceId)
+    {
+        return Vec(x_hp * x_percentileKnobXHP,
+                   x_hp * (x_firstVoiceYHP + voiceId * x_voiceSpacingYHP + x_controlRowOffsetYHP));
+    }
+
+    Vec GetPitchPercentileJackMM(size_t voiceId)
+    {
+        return GetPercentileKnobMM(voiceId).plus(Vec(x_hp * x_jackSpacingXHP, 0));
+    }
+
+    Vec GetMainOutputJackMM(size_t voiceId)
+    {
+        return GetPercentileKnobMM(voiceId).plus(Vec(2 * x_hp * x_jackSpacingXHP, 0));
+    }
+
+    Vec GetTriggerOutputJackMM(size_t voiceId)
+    {
+        return GetPercentileKnobMM(voiceId).plus(Vec(3 * x_hp * x_jackSpacingXHP, 0));
+    }
+
+    Vec JackToLight(Vec jackPos)
+    {
+        return jackPos.plus(Vec(x_hp * x_jackLightOffsetHP, - x_hp * x_jackLightOffsetHP));
+    }
+
+    VoiceExpanderWidget(VoiceExpander* module)
+    {
+        using namespace VoiceExpanderConstants;
+
+        setModule(module);
+        setPanel(createPanel(asset::plugin(pluginInstance, "res/VoiceExpander.svg")));
+
+        addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+        addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+        addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+        addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+        for (size_t i = 0; i < x_numVoices; ++i)
+        {
+            for (size_t j = 0; j < LogicMatrixConstants::x_numInputs; ++j)
+            {
+                addParam(createParamCentered<NKK>(
+                             mm2px(GetCoMuteSwitchMM(j, i)),
+                             module,
+                             GetPitchCoMuteSwitchId(j, i)));
+            }
+
+            addParam(createParamCentered<RoundBlackKnob>(
+                         mm2px(GetPercentileKnobMM(i)),
+                         module,
+                         GetPitchPercentileKnobId(i)));
+            addInput(createInputCentered<PJ301MPort>(
+                         mm2px(GetPitchPercentileJackMM(i)),
+                         module,
+                         GetPitchPercentileCVInputId(i)));
+            addOutput(createOutputCentered<PJ301MPort>(
+                          mm2px(GetMainOutputJackMM(i)),
+                          module,
+                          GetMainOutputId(i)));
+            addOutput(createOutputCentered<PJ301MPort>(
+                          mm2px(GetTriggerOutputJackMM(i)),
+                          module,
+                          GetTriggerOutputId(i)));
+            addChild(createLightCentered<MediumLight<RedLight>>(
+                         mm2px(JackToLight(GetTriggerOutputJackMM(i))),
+                         module,
+                         GetTriggerLightId(i)));
+        }
+    }
+};
+
+Model* modelVoiceExpander = createModel<VoiceExpander, VoiceExpanderWidget>("VoiceExpander");
@@ -1,4 +1,5 @@
 #include "plugin.hpp"
+#include "BitKernels.hpp"
 
 
 Plugin* pluginInstance;
@@ -6,10 +7,12 @@ Plugin* pluginInstance;
 
 void init(Plugin* p) {
 	pluginInstance = p;
+    BitKernels::Init();
 
 	// Add modules here
     p->addModel(modelLogicMatrix);
     p->addModel(modelLatticeExpander);
+    p->addModel(modelVoiceExpander);
 
 	// Any other plugin initialization may go here.
 	// As an alternative, consider lazy-loading assets and lookup tables when your module is created to reduce startup times of Rack.
@@ -0,0 +1,392 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <execinfo.h>
+#include <malloc.h>
+#include <unistd.h>
+#include "TestRig.hpp"
+
+// Fails on the first heap allocation or free made by LogicMatrix::process or
+// LatticeExpander::process.  The allocator is interposed, so this covers the Rack library and
+// the standard library as well as the plugin, but it relies on glibc and only builds on Linux.
+//
+// The scenarios drive the audio thread through the paths that could allocate: params swept
+// through their ranges, cables patched and unpatched (including polyphonic CV), expanders
+// attached and detached, and tracing, recording and replay running throughout.
+//
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+namespace
+{
+    // Only the thread running process is armed, so the writer threads can allocate freely.
+    //
+    thread_local bool t_armed = false;
+    thread_local const char* t_where = "";
+
+    // While checking the trap itself, a hit is counted instead of failing.
+    //
+    bool g_selfTest = false;
+    int g_numSelfTestHits = 0;
+
+    void OnAllocation(const char* what)
+    {
+        if (!t_armed)
+        {
+            return;
+        }
+
+        t_armed = false;
+        if (g_selfTest)
+        {
+            ++g_numSelfTestHits;
+            t_armed = true;
+            return;
+        }
+
+        fprintf(stderr, "AllocTest: %s during %s\n", what, t_where);
+        void* frames[32];
+        int numFrames = backtrace(frames, 32);
+        backtrace_symbols_fd(frames, numFrames, 2);
+        _exit(1);
+    }
+}
+
+extern "C" void* malloc(size_t size)
+{
+    OnAllocation("malloc");
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    OnAllocation("calloc");
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    OnAllocation("realloc");
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    OnAllocation("memalign");
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    OnAllocation("aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    OnAllocation("posix_memalign");
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : 12;
+}
+
+extern "C" void free(void* ptr)
+{
+    if (ptr)
+    {
+        OnAllocation("free");
+    }
+
+    __libc_free(ptr);
+}
+
+void* operator new(size_t size)
+{
+    OnAllocation("new");
+    void* ptr = __libc_malloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    OnAllocation("new[]");
+    void* ptr = __libc_malloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr)
+    {
+        OnAllocation("delete");
+    }
+
+    __libc_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    if (ptr)
+    {
+        OnAllocation("delete[]");
+    }
+
+    __libc_free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    operator delete[](ptr);
+}
+
+using namespace LogicMatrixConstants;
+
+static constexpr int x_numFramesPerScenario = 100000;
+
+struct Rig
+{
+    LogicMatrix m_left;
+    LogicMatrix m_right;
+    LatticeExpander m_expander;
+    rack::engine::Module::ProcessArgs m_args;
+    TestRig::Lcg m_lcg;
+
+    Rig()
+    {
+        m_left.id = 1;
+        m_right.id = 2;
+        m_expander.id = 3;
+        m_left.model = modelLogicMatrix;
+        m_right.model = modelLogicMatrix;
+        m_expander.model = modelLatticeExpander;
+
+        m_args.sampleRate = 48000.f;
+        m_args.sampleTime = 1.f / 48000.f;
+        m_args.frame = 0;
+
+        m_right.SetChainMode(LogicMatrix::ChainMode::LeftOperations);
+        m_left.SetSelection(1, LogicMatrix::Selection::Random);
+        m_right.SetSelection(2, LogicMatrix::Selection::RandomWeighted);
+        m_left.m_distributionDisplayed.store(true);
+        m_right.m_distinctPitches.store(true);
+
+        for (size_t i = 0; i < GetNumOutputs(); ++i)
+        {
+            TestRig::Patch(&m_left.outputs[i], true);
+            TestRig::Patch(&m_right.outputs[i], i % 2 == 0);
+        }
+
+        TestRig::Patch(&m_left.inputs[GetMainInputId(0)], true);
+        TestRig::Patch(&m_right.inputs[GetMainInputId(1)], true);
+        TestRig::Attach(&m_left, &m_right);
+        TestRig::Attach(&m_right, &m_expander);
+        m_expander.ToggleCell(0, 0);
+    }
+
+    void Step()
+    {
+        for (size_t i = 0; i < GetNumInputs(); ++i)
+        {
+            float gate = (m_args.frame / (7 + i)) % 2 ? 5.f : 0.f;
+            if (m_left.inputs[i].isConnected())
+            {
+                m_left.inputs[i].setVoltage(gate);
+            }
+
+            if (m_right.inputs[i].isConnected())
+            {
+                m_right.inputs[i].setVoltage(5.f - gate);
+            }
+        }
+
+        t_armed = true;
+        t_where = "LogicMatrix::process";
+        m_left.process(m_args);
+        m_right.process(m_args);
+        t_where = "LatticeExpander::process";
+        m_expander.process(m_args);
+        t_armed = false;
+
+        TestRig::FlipMessages(&m_left);
+        TestRig::FlipMessages(&m_right);
+        TestRig::FlipMessages(&m_expander);
+        ++m_args.frame;
+    }
+};
+
+// Every param through every whole value in its range, one param every few samples, with the
+// operator definitions, selections and distinct pitches changing along the way.
+//
+static void SweepParams(Rig* rig)
+{
+    typedef LogicMatrix::LogicOperation::OperatorDefinition OperatorDefinition;
+
+    for (int i = 0; i < x_numFramesPerScenario; ++i)
+    {
+        if (i % 16 == 0)
+        {
+            size_t paramId = (i / 16) % GetNumParams();
+            rack::engine::ParamQuantity* quantity = rig->m_left.paramQuantities[paramId];
+            float value = ((i / 16 / GetNumParams()) % 9);
+            if (quantity)
+            {
+                value = std::min(value, quantity->getMaxValue());
+            }
+
+            rig->m_left.params[paramId].setValue(value);
+            rig->m_right.params[paramId].setValue(value / 2);
+        }
+
+        if (i % 5000 == 0)
+        {
+            OperatorDefinition definition;
+            definition.m_type = static_cast<OperatorDefinition::Type>((i / 5000) % static_cast<int>(OperatorDefinition::Type::NumTypes));
+            definition.m_k = (i / 5000) % (x_numInputs + 1);
+            definition.m_truthTable = rig->m_lcg.Next() * 0x9e3779b97f4a7c15ull;
+            rig->m_left.m_operations[(i / 5000) % x_numOperations].SetDefinition(definition);
+            rig->m_left.m_operations[(i / 5000) % x_numOperations].SetOperationInputs(rig->m_lcg.Below(1 << x_numOperations));
+            rig->m_left.SetSelection((i / 5000) % x_numAccumulators, static_cast<LogicMatrix::Selection>(rig->m_lcg.Below(3)));
+            rig->m_left.m_distinctPitches.store(!rig->m_left.m_distinctPitches.load());
+            rig->m_left.m_reseedRequested.store(true);
+        }
+
+        rig->Step();
+    }
+}
+
+// Inputs and outputs patched and unpatched at random, and interval CV between mono and
+// polyphonic.
+//
+static void ChangeCables(Rig* rig)
+{
+    for (int i = 0; i < x_numFramesPerScenario; ++i)
+    {
+        if (i % 257 == 0)
+        {
+            rack::engine::Input& input = rig->m_left.inputs[rig->m_lcg.Below(GetNumInputs())];
+            TestRig::Patch(&input, !input.isConnected());
+        }
+
+        if (i % 389 == 0)
+        {
+            rack::engine::Output& output = rig->m_left.outputs[rig->m_lcg.Below(GetNumOutputs())];
+            TestRig::Patch(&output, !output.isConnected());
+        }
+
+        if (i % 1009 == 0)
+        {
+            rack::engine::Input& intervalCV = rig->m_left.inputs[GetIntervalCVInputId(rig->m_lcg.Below(x_numAccumulators))];
+            intervalCV.channels = (intervalCV.channels + 4) % 12;
+            for (int c = 0; c < intervalCV.channels; ++c)
+            {
+                intervalCV.setVoltage(0.01f * c, c);
+            }
+        }
+
+        rig->Step();
+    }
+}
+
+// The chained LogicMatrix and the LatticeExpander come and go.
+//
+static void AttachExpanders(Rig* rig)
+{
+    for (int i = 0; i < x_numFramesPerScenario; ++i)
+    {
+        if (i % 3001 == 0)
+        {
+            if (rig->m_left.rightExpander.module)
+            {
+                TestRig::Detach(&rig->m_left, &rig->m_right);
+            }
+            else
+            {
+                TestRig::Attach(&rig->m_left, &rig->m_right);
+            }
+        }
+
+        if (i % 4999 == 0)
+        {
+            if (rig->m_right.rightExpander.module)
+            {
+                TestRig::Detach(&rig->m_right, &rig->m_expander);
+            }
+            else
+            {
+                TestRig::Attach(&rig->m_right, &rig->m_expander);
+            }
+        }
+
+        rig->Step();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* recordingPath = argc > 1 ? argv[1] : "AllocTest.lmrec";
+
+    // Make sure the trap springs before trusting a clean run.
+    //
+    g_selfTest = true;
+    t_armed = true;
+    int* probe = new int(1);
+    delete probe;
+    free(malloc(16));
+    t_armed = false;
+    g_selfTest = false;
+    if (g_numSelfTestHits != 4)
+    {
+        fprintf(stderr, "AllocTest: allocator not interposed (%d of 4 caught)\n", g_numSelfTestHits);
+        return 1;
+    }
+
+    BitKernels::Init();
+    Rig* rig = new Rig();
+    rig->m_left.m_tracer.Start("AllocTest.left.trace.json", rig->m_left.id);
+    rig->m_expander.m_tracer.Start("AllocTest.expander.trace.json", rig->m_expander.id);
+    if (!rig->m_left.m_recorder.Start(recordingPath))
+    {
+        fprintf(stderr, "AllocTest: couldn't write %s\n", recordingPath);
+        return 1;
+    }
+
+    SweepParams(rig);
+    ChangeCables(rig);
+    AttachExpanders(rig);
+
+    rig->m_left.m_recorder.Stop();
+    rig->m_left.m_tracer.Stop();
+    rig->m_expander.m_tracer.Stop();
+
+    if (!rig->m_left.m_player.Load(recordingPath))
+    {
+        fprintf(stderr, "AllocTest: couldn't load %s\n", recordingPath);
+        return 1;
+    }
+
+    while (rig->m_left.m_player.IsPlaying())
+    {
+        rig->Step();
+    }
+
+    delete rig;
+    printf("AllocTest: no allocations during process\n");
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <cstdio>
+#include "TestRig.hpp"
+
+// Measures edge-to-output latency on two chained LogicMatrix modules, the right one with a
+// LatticeExpander, and fails if any path took a number of samples outside its expected range, or
+// if a path the patch should exercise was never measured.
+//
+using namespace LogicMatrixConstants;
+
+static constexpr int x_numFrames = 48000;
+static constexpr int x_warmupFrames = 256;
+static constexpr float x_sampleRate = 48000.f;
+
+// Every path gets measurements from this patch except the lights, which the left module has no
+// expander for.
+//
+static bool Check(const char* name, Latency::Meter* const* meters, size_t numMeters, uint32_t lightDivision)
+{
+    bool ok = true;
+    for (size_t i = 0; i < Latency::x_numPaths; ++i)
+    {
+        bool lattice = i >= static_cast<size_t>(Latency::Path::LatticeMessage);
+        if (lattice && numMeters < 2)
+        {
+            continue;
+        }
+
+        Latency::Summary summary(meters, numMeters, i, lightDivision);
+        printf("%s %s: %u measured, %u unexpected\n", name, Latency::x_pathNames[i], summary.m_total, summary.m_unexpected);
+        if (summary.m_total == 0 || summary.m_unexpected > 0)
+        {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    LogicMatrix left;
+    LogicMatrix right;
+    LatticeExpander expander;
+    left.id = 1;
+    right.id = 2;
+    expander.id = 3;
+    left.model = modelLogicMatrix;
+    right.model = modelLogicMatrix;
+    expander.model = modelLatticeExpander;
+    TestRig::Attach(&left, &right);
+    TestRig::Attach(&right, &expander);
+    right.SetChainMode(LogicMatrix::ChainMode::LeftOperations);
+
+    TestRig::Lcg lcg;
+    for (size_t i = 0; i < GetNumParams(); ++i)
+    {
+        left.params[i].setValue(lcg.Below(3));
+        right.params[i].setValue(lcg.Below(3));
+    }
+
+    for (size_t i = 0; i < GetNumOutputs(); ++i)
+    {
+        TestRig::Patch(&left.outputs[i], true);
+        TestRig::Patch(&right.outputs[i], true);
+    }
+
+    TestRig::Patch(&left.inputs[GetMainInputId(0)], true);
+    TestRig::Patch(&left.inputs[GetMainInputId(2)], true);
+    TestRig::Patch(&left.inputs[GetMainInputId(3)], true);
+    TestRig::Patch(&right.inputs[GetMainInputId(1)], true);
+
+    rack::engine::Module::ProcessArgs args;
+    args.sampleRate = x_sampleRate;
+    args.sampleTime = 1.f / x_sampleRate;
+    args.frame = 0;
+
+    for (int i = 0; i < x_warmupFrames + x_numFrames; ++i)
+    {
+        if (i == x_warmupFrames)
+        {
+            left.m_latency.Start();
+            right.m_latency.Start();
+            expander.m_latency.Start();
+        }
+
+        left.inputs[GetMainInputId(0)].setVoltage((i / 37) % 2 ? 5.f : 0.f);
+        left.inputs[GetMainInputId(2)].setVoltage((i / 101) % 2 ? 5.f : 0.f);
+        left.inputs[GetMainInputId(3)].setVoltage((i / 173) % 2 ? 5.f : 0.f);
+        right.inputs[GetMainInputId(1)].setVoltage((i / 59) % 2 ? 5.f : 0.f);
+
+        left.process(args);
+        right.process(args);
+        expander.process(args);
+        TestRig::FlipMessages(&left);
+        TestRig::FlipMessages(&right);
+        TestRig::FlipMessages(&expander);
+        ++args.frame;
+    }
+
+    left.m_latency.Stop();
+    right.m_latency.Stop();
+    expander.m_latency.Stop();
+
+    Latency::Meter* leftMeters[] = {&left.m_latency};
+    Latency::Meter* rightMeters[] = {&right.m_latency, &expander.m_latency};
+    Latency::WriteReport("LatencyTest.left.latency.json", leftMeters, 1, left.m_lightDivider.getDivision(), x_sampleRate);
+    Latency::WriteReport("LatencyTest.right.latency.json", rightMeters, 2, right.m_lightDivider.getDivision(), x_sampleRate);
+
+    bool ok = Check("left", leftMeters, 1, left.m_lightDivider.getDivision());
+    ok = Check("right", rightMeters, 2, right.m_lightDivider.getDivision()) && ok;
+    printf("LatencyTest: %s\n", ok ? "all paths within their expected range" : "FAILED");
+    return ok ? 0 : 1;
+}
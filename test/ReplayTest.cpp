@@ -0,0 +1,310 @@
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "TestRig.hpp"
+
+// Records a LogicMatrix while its params, operator definitions, operation inputs, scale masks,
+// distinct pitches, selections, random seed and patched outputs all change, then replays the
+// recording on a fresh LogicMatrix set up differently and checks every output that was
+// patched matches bit for bit.  Also checks a recording that dropped records won't load.
+//
+using namespace LogicMatrixConstants;
+typedef LogicMatrix::LogicOperation::OperatorDefinition OperatorDefinition;
+
+static constexpr int x_numFrames = 48000;
+static constexpr int x_blockSize = 256;
+static constexpr float x_sampleRate = 48000.f;
+
+struct Frame
+{
+    float m_voltages[GetNumOutputs()];
+    bool m_connected[GetNumOutputs()];
+};
+
+static void SetDefinition(LogicMatrix* module, size_t operation, OperatorDefinition::Type type, uint8_t k, uint64_t truthTable)
+{
+    OperatorDefinition definition;
+    definition.m_type = type;
+    definition.m_k = k;
+    definition.m_truthTable = truthTable;
+    module->m_operations[operation].SetDefinition(definition);
+}
+
+// Changes something on the module every so often, on a fixed schedule.
+//
+static void Edit(int frame, LogicMatrix* module, LatticeExpander* expander, TestRig::Lcg* lcg)
+{
+    if (frame % 3000 == 0)
+    {
+        module->params[lcg->Below(GetNumParams())].setValue(lcg->Below(3));
+    }
+
+    switch (frame)
+    {
+        case 6000: SetDefinition(module, 2, OperatorDefinition::Type::Exactly, 3, 0); break;
+        case 9000: module->SetSelection(2, LogicMatrix::Selection::Random); break;
+        case 12000: module->m_distinctPitches.store(false); break;
+        case 15000:
+        {
+            module->m_seed.store(1234);
+            module->m_reseedRequested.store(true);
+            break;
+        }
+        case 18000:
+        {
+            expander->m_maskVoice = 1;
+            expander->ToggleCell(1, 1);
+            expander->ToggleCell(2, 0);
+            break;
+        }
+        case 24000: module->m_operations[5].SetOperationInputs(0x3); break;
+        case 30000:
+        {
+            TestRig::Patch(&module->outputs[GetMainOutputId(2)], false);
+            TestRig::Patch(&module->outputs[GetTriggerOutputId(2)], false);
+            break;
+        }
+        case 36000:
+        {
+            TestRig::Patch(&module->outputs[GetMainOutputId(2)], true);
+            TestRig::Patch(&module->outputs[GetTriggerOutputId(2)], true);
+            break;
+        }
+        case 42000: SetDefinition(module, 0, OperatorDefinition::Type::TruthTable, 1, 0x0123456789abcdefull); break;
+    }
+}
+
+static void Capture(LogicMatrix* module, Frame* frame)
+{
+    for (size_t i = 0; i < GetNumOutputs(); ++i)
+    {
+        frame->m_voltages[i] = module->outputs[i].getVoltage();
+        frame->m_connected[i] = module->outputs[i].isConnected();
+    }
+}
+
+static bool Record(const char* path, std::vector<Frame>* frames)
+{
+    LogicMatrix module;
+    LatticeExpander expander;
+    module.id = 1;
+    expander.id = 2;
+    module.model = modelLogicMatrix;
+    expander.model = modelLatticeExpander;
+    TestRig::Attach(&module, &expander);
+
+    TestRig::Lcg lcg;
+    for (size_t i = 0; i < GetNumParams(); ++i)
+    {
+        module.params[i].setValue(lcg.Below(3));
+    }
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        module.params[GetPitchPercentileKnobId(i)].setValue(lcg.Below(100) / 100.f);
+    }
+
+    // With the same interval on two accumulators, distinct pitches depends on knowing which
+    // accumulators the interval CV moves.
+    //
+    module.params[GetAccumulatorIntervalKnobId(0)].setValue(2);
+    module.params[GetAccumulatorIntervalKnobId(1)].setValue(2);
+
+    for (size_t i = 0; i < GetNumOutputs(); ++i)
+    {
+        TestRig::Patch(&module.outputs[i], true);
+    }
+
+    TestRig::Patch(&module.inputs[GetMainInputId(0)], true);
+    TestRig::Patch(&module.inputs[GetMainInputId(3)], true);
+    TestRig::Patch(&module.inputs[GetIntervalCVInputId(1)], true);
+    TestRig::Patch(&module.inputs[GetPitchPercentileCVInputId(0)], true);
+
+    SetDefinition(&module, 1, OperatorDefinition::Type::AtLeast, 2, 0);
+    SetDefinition(&module, 3, OperatorDefinition::Type::TruthTable, 1, 0xf0f0a5a5c3c3ff00ull);
+    module.m_operations[4].SetOperationInputs(0x1);
+    module.m_distinctPitches.store(true);
+    module.SetSelection(0, LogicMatrix::Selection::Random);
+    module.SetSelection(1, LogicMatrix::Selection::RandomWeighted);
+    expander.m_maskVoice = 0;
+    expander.ToggleCell(0, 0);
+    expander.ToggleCell(1, 0);
+
+    rack::engine::Module::ProcessArgs args;
+    args.sampleRate = x_sampleRate;
+    args.sampleTime = 1.f / x_sampleRate;
+    args.frame = 0;
+
+    // Let the expander's masks reach the module before recording starts.
+    //
+    for (int i = 0; i < x_blockSize; ++i)
+    {
+        module.process(args);
+        expander.process(args);
+        TestRig::FlipMessages(&module);
+        TestRig::FlipMessages(&expander);
+        ++args.frame;
+    }
+
+    for (size_t i = 0; i < x_numAccumulators; ++i)
+    {
+        uint64_t cellMask = expander.m_cellMasks[i].load();
+        if (module.m_paramsWatcher.m_state.m_cellMasks[i] != cellMask)
+        {
+            printf("voice %zu's scale mask didn't reach the module before recording\n", i);
+            return false;
+        }
+    }
+
+    if (module.m_paramsWatcher.m_state.m_cellMasks[0] == 0)
+    {
+        printf("voice 0 has no scale mask to record\n");
+        return false;
+    }
+
+    if (!module.m_recorder.Start(path))
+    {
+        printf("couldn't write %s\n", path);
+        return false;
+    }
+
+    frames->resize(x_numFrames);
+    for (int i = 0; i < x_numFrames; ++i)
+    {
+        Edit(i, &module, &expander, &lcg);
+        module.inputs[GetMainInputId(0)].setVoltage((i / 37) % 2 ? 5.f : 0.f);
+        module.inputs[GetMainInputId(3)].setVoltage((i / 101) % 2 ? 5.f : 0.f);
+        module.inputs[GetIntervalCVInputId(1)].setVoltage(0.01f * (i % 100));
+        module.inputs[GetPitchPercentileCVInputId(0)].setVoltage(5.f * ((i / 500) % 7) / 7.f);
+
+        module.process(args);
+        expander.process(args);
+        TestRig::FlipMessages(&module);
+        TestRig::FlipMessages(&expander);
+        ++args.frame;
+
+        Capture(&module, &(*frames)[i]);
+
+        // Run at about real time, so the writer keeps up as it would in Rack.
+        //
+        if (i % x_blockSize == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    module.m_recorder.Stop();
+    uint64_t numDropped = module.m_recorder.m_numDropped.load();
+    if (numDropped != 0)
+    {
+        printf("recording dropped %llu records\n", static_cast<unsigned long long>(numDropped));
+        return false;
+    }
+
+    return true;
+}
+
+// The replaying module starts from default params, definitions and selections, with no
+// expander and a different seed, chain mode and sample rate, so anything the recording misses
+// shows up.
+//
+static size_t Replay(const char* path, const std::vector<Frame>& frames)
+{
+    LogicMatrix module;
+    module.m_seed.store(99);
+    module.SetChainMode(LogicMatrix::ChainMode::LeftOperations);
+    for (size_t i = 0; i < GetNumOutputs(); ++i)
+    {
+        TestRig::Patch(&module.outputs[i], true);
+    }
+
+    if (!module.m_player.Load(path))
+    {
+        printf("couldn't load %s\n", path);
+        return 1;
+    }
+
+    rack::engine::Module::ProcessArgs args;
+    args.sampleRate = 44100.f;
+    args.sampleTime = 1.f / 44100.f;
+    args.frame = 0;
+
+    size_t numMismatches = 0;
+    for (int i = 0; i < x_numFrames; ++i)
+    {
+        module.process(args);
+        TestRig::FlipMessages(&module);
+        ++args.frame;
+
+        Frame frame;
+        Capture(&module, &frame);
+        for (size_t j = 0; j < GetNumOutputs(); ++j)
+        {
+            if (frames[i].m_connected[j] && memcmp(&frame.m_voltages[j], &frames[i].m_voltages[j], sizeof(float)) != 0)
+            {
+                if (numMismatches == 0)
+                {
+                    printf("first mismatch at frame %d, output %zu: recorded %.9g, replayed %.9g\n", i, j, frames[i].m_voltages[j], frame.m_voltages[j]);
+                }
+
+                ++numMismatches;
+            }
+        }
+    }
+
+    module.process(args);
+    if (module.m_player.IsPlaying())
+    {
+        printf("still playing after the last recorded sample\n");
+        ++numMismatches;
+    }
+
+    return numMismatches;
+}
+
+// A recording that dropped records can't replay exactly, so it shouldn't load.
+//
+static bool CheckDroppedRejected(const char* path)
+{
+    FILE* file = fopen(path, "r+b");
+    if (!file)
+    {
+        return false;
+    }
+
+    Recording::Header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1;
+    header.m_numDropped = 1;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    fclose(file);
+
+    LogicMatrix module;
+    if (!ok || module.m_player.Load(path))
+    {
+        printf("loaded a recording that dropped records\n");
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "ReplayTest.lmrec";
+
+    std::vector<Frame> frames;
+    if (!Record(path, &frames))
+    {
+        return 1;
+    }
+
+    size_t numMismatches = Replay(path, frames);
+    printf("ReplayTest: %d frames, %zu mismatches\n", x_numFrames, numMismatches);
+    if (!CheckDroppedRejected(path))
+    {
+        return 1;
+    }
+
+    return numMismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <utility>
+#include "LogicMatrix.hpp"
+#include "LatticeExpander.hpp"
+
+// The test programs run modules without the Rack engine.  This stands in for the parts of the
+// engine and plugin they need.  Each program is a single translation unit, so the globals the
+// plugin would define are defined here.
+//
+Plugin* pluginInstance = nullptr;
+Model* modelLogicMatrix = new Model();
+Model* modelLatticeExpander = new Model();
+Model* modelVoiceExpander = new Model();
+
+namespace TestRig
+{
+    inline void FlipMessages(Module::Expander* expander)
+    {
+        if (expander->messageFlipRequested)
+        {
+            std::swap(expander->producerMessage, expander->consumerMessage);
+            expander->messageFlipRequested = false;
+        }
+    }
+
+    // What the engine does after every frame: swap the expander message buffers that were asked for.
+    //
+    inline void FlipMessages(Module* module)
+    {
+        FlipMessages(&module->leftExpander);
+        FlipMessages(&module->rightExpander);
+    }
+
+    inline void Attach(Module* left, Module* right)
+    {
+        left->rightExpander.module = right;
+        left->rightExpander.moduleId = right->id;
+        right->leftExpander.module = left;
+        right->leftExpander.moduleId = left->id;
+    }
+
+    inline void Detach(Module* left, Module* right)
+    {
+        left->rightExpander.module = nullptr;
+        left->rightExpander.moduleId = -1;
+        right->leftExpander.module = nullptr;
+        right->leftExpander.moduleId = -1;
+    }
+
+    inline void Patch(rack::engine::Port* port, bool connected)
+    {
+        port->channels = connected ? 1 : 0;
+    }
+
+    // A small fixed random sequence, so runs are the same everywhere.
+    //
+    struct Lcg
+    {
+        uint32_t m_state = 1;
+
+        uint32_t Next()
+        {
+            m_state = m_state * 1664525u + 1013904223u;
+            return m_state >> 8;
+        }
+
+        uint32_t Below(uint32_t n)
+        {
+            return Next() % n;
+        }
+    };
+}
@@ -0,0 +1,204 @@
+#include <cstdio>
+#include "TestRig.hpp"
+#include "VoiceExpander.hpp"
+
+// Runs a LogicMatrix with a VoiceExpander on its right, giving the expander's voices the co-mute
+// switches and percentiles the LogicMatrix's own voices had a sample earlier, and checks each
+// expander voice lands on exactly the pitch its LogicMatrix voice did.  The params are latched
+// and moved every sample, so the expander keeps reading one VoicePositions table while the other
+// is rewritten, and the two modules take turns at running first, as they would on different
+// engine threads.  Halfway through, the LogicMatrix is removed and replaced, which must leave
+// the expander idle until the new one's first message, rather than reading the old one.
+//
+using namespace LogicMatrixConstants;
+
+static constexpr int x_numFrames = 48000;
+static constexpr float x_sampleRate = 48000.f;
+
+// Which LogicMatrix voice each expander voice copies.
+//
+static size_t GetMirroredVoice(size_t voiceId)
+{
+    return voiceId % x_numAccumulators;
+}
+
+static LogicMatrix* CreateLogicMatrix(VoiceExpander* expander)
+{
+    LogicMatrix* module = new LogicMatrix();
+    module->id = 1;
+    module->model = modelLogicMatrix;
+    module->m_paramsCheckDivider.setDivision(1);
+    for (size_t i = 0; i < GetNumOutputs(); ++i)
+    {
+        TestRig::Patch(&module->outputs[i], true);
+    }
+
+    TestRig::Patch(&module->inputs[GetMainInputId(0)], true);
+    TestRig::Patch(&module->inputs[GetIntervalCVInputId(1)], true);
+    TestRig::Attach(module, expander);
+
+    // Rack tells both neighbours when a module is added or removed, between blocks.
+    //
+    Module::ExpanderChangeEvent e;
+    e.side = 0;
+    expander->onExpanderChange(e);
+    return module;
+}
+
+static void RemoveLogicMatrix(LogicMatrix* module, VoiceExpander* expander)
+{
+    TestRig::Detach(module, expander);
+    Module::ExpanderChangeEvent e;
+    e.side = 0;
+    expander->onExpanderChange(e);
+    delete module;
+}
+
+// One param of each kind that moves the candidates or the pick.
+//
+static void Edit(int frame, LogicMatrix* module, TestRig::Lcg* lcg)
+{
+    module->params[GetMatrixSwitchId(lcg->Below(x_numInputs), lcg->Below(x_numOperations))].setValue(lcg->Below(3));
+    module->params[GetPitchCoMuteSwitchId(lcg->Below(x_numInputs), lcg->Below(x_numAccumulators))].setValue(lcg->Below(2));
+    module->params[GetPitchPercentileKnobId(lcg->Below(x_numAccumulators))].setValue(lcg->Below(100) / 100.f);
+    if (frame % 7 == 0)
+    {
+        module->params[GetAccumulatorIntervalKnobId(lcg->Below(x_numAccumulators))].setValue(lcg->Below(x_numIntervals));
+    }
+
+    if (frame % 5000 == 0)
+    {
+        module->m_distinctPitches.store(!module->m_distinctPitches.load());
+    }
+
+    module->inputs[GetMainInputId(0)].setVoltage((frame / 37) % 2 ? 5.f : 0.f);
+
+    // At 0V the interval CV leaves the ratio as it is, which distinct pitches treats differently.
+    //
+    module->inputs[GetIntervalCVInputId(1)].setVoltage((frame / 300) % 3 == 0 ? 0.f : 0.01f * ((frame / 300) % 50));
+}
+
+int main(int argc, char** argv)
+{
+    using VoiceExpanderConstants::x_numVoices;
+
+    BitKernels::Init();
+
+    VoiceExpander expander;
+    expander.id = 2;
+    expander.model = modelVoiceExpander;
+    for (size_t i = 0; i < VoiceExpanderConstants::GetNumOutputs(); ++i)
+    {
+        TestRig::Patch(&expander.outputs[i], true);
+    }
+
+    LogicMatrix* module = CreateLogicMatrix(&expander);
+    TestRig::Lcg lcg;
+
+    rack::engine::Module::ProcessArgs args;
+    args.sampleRate = x_sampleRate;
+    args.sampleTime = 1.f / x_sampleRate;
+    args.frame = 0;
+
+    float lastPitches[x_numAccumulators] = {};
+    float lastCoMutes[x_numAccumulators][x_numInputs] = {};
+    float lastPercentiles[x_numAccumulators] = {};
+    bool lastValid = false;
+
+    size_t numChecked = 0;
+    size_t numMismatches = 0;
+    size_t numStale = 0;
+    for (int i = 0; i < x_numFrames; ++i)
+    {
+        bool replaced = i == x_numFrames / 2;
+        if (replaced)
+        {
+            RemoveLogicMatrix(module, &expander);
+            for (int j = 0; j < 64; ++j)
+            {
+                expander.process(args);
+                TestRig::FlipMessages(&expander);
+                for (size_t k = 0; k < x_numVoices; ++k)
+                {
+                    numStale += expander.m_voices[k].m_output.m_active;
+                }
+            }
+
+            module = CreateLogicMatrix(&expander);
+            lastValid = false;
+        }
+
+        for (size_t j = 0; j < x_numVoices; ++j)
+        {
+            size_t voice = GetMirroredVoice(j);
+            for (size_t k = 0; k < x_numInputs; ++k)
+            {
+                expander.params[VoiceExpanderConstants::GetPitchCoMuteSwitchId(k, j)].setValue(lastCoMutes[voice][k]);
+            }
+
+            expander.params[VoiceExpanderConstants::GetPitchPercentileKnobId(j)].setValue(lastPercentiles[voice]);
+        }
+
+        Edit(i, module, &lcg);
+
+        if (i % 2 == 0)
+        {
+            module->process(args);
+            expander.process(args);
+        }
+        else
+        {
+            expander.process(args);
+            module->process(args);
+        }
+
+        TestRig::FlipMessages(module);
+        TestRig::FlipMessages(&expander);
+        ++args.frame;
+
+        for (size_t j = 0; replaced && j < x_numVoices; ++j)
+        {
+            numStale += expander.m_voices[j].m_output.m_active;
+        }
+
+        for (size_t j = 0; lastValid && j < x_numVoices; ++j)
+        {
+            if (!expander.m_voices[j].m_output.m_active)
+            {
+                continue;
+            }
+
+            float pitch = expander.outputs[VoiceExpanderConstants::GetMainOutputId(j)].getVoltage();
+            float expected = lastPitches[GetMirroredVoice(j)];
+            ++numChecked;
+            if (memcmp(&pitch, &expected, sizeof(float)) != 0)
+            {
+                if (numMismatches == 0)
+                {
+                    printf("first mismatch at frame %d, voice %zu: expected %.9g, got %.9g\n", i, j, expected, pitch);
+                }
+
+                ++numMismatches;
+            }
+        }
+
+        for (size_t j = 0; j < x_numAccumulators; ++j)
+        {
+            lastPitches[j] = module->outputs[GetMainOutputId(j)].getVoltage();
+            for (size_t k = 0; k < x_numInputs; ++k)
+            {
+                lastCoMutes[j][k] = module->params[GetPitchCoMuteSwitchId(k, j)].getValue();
+            }
+
+            lastPercentiles[j] = module->params[GetPitchPercentileKnobId(j)].getValue();
+        }
+
+        lastValid = true;
+    }
+
+    delete module;
+
+    bool ok = numMismatches == 0 && numStale == 0 && numChecked > x_numVoices * x_numFrames * 9 / 10;
+    printf("VoiceTest: %zu voice samples checked, %zu mismatches, %zu from a removed LogicMatrix\n", numChecked, numMismatches, numStale);
+    return ok ? 0 : 1;
+}